@@ -0,0 +1,284 @@
+/*
+ * Engine scaling benchmark for CS352 RDP
+ *
+ * A client opens -c idle connections and -a active ones to a server.
+ * The server registers every connection it accepts in one
+ * sock352_epoll set and echoes whatever arrives; the client sends a
+ * small message on each active connection -r times a second (at most
+ * one in flight, -r 0 for the next one as soon as the echo is back),
+ * waiting for the echoes with sock352_epoll_wait. Idle connections
+ * should cost nothing: the round trip rate and latency should not move
+ * with -c. Both ends run in their own process, each run lasts -t seconds.
+ *
+ * usage: bench_engine [-c idle connections]... [-a active connections] [-r messages/s per connection] [-t seconds] [-b message bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "sock352.h"
+
+#define MAX_RUNS 16
+#define MAX_EVENTS 1024
+
+/*
+ * What a run reports back to the parent
+ */
+struct result{
+    double trips; /* round trips completed */
+    double seconds; /* time they took */
+    double median; /* round trip time (seconds) */
+    double p99;
+    double waits; /* sock352_epoll_wait calls of the client */
+};
+
+/*
+ * Seconds on the monotonic clock
+ */
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compareDoubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * The server: accept every connection into one epoll set and echo each
+ * full message back; a connection the client closes leaves the set
+ */
+int runServer(int port, int total, int size){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, 128) < 0) return 1;
+
+    int epfd = sock352_epoll_create(1);
+    if(epfd < 0) return 1;
+
+    /*
+     * sock352 fds count up from 1
+     */
+    int max_fd = total + 64;
+    int *got = calloc(max_fd, sizeof(int));
+    char *bufs = malloc((size_t)max_fd * size);
+
+    int i=0;
+    for(;i<total;i++){
+        int len = sizeof(addr);
+        int fd = sock352_accept(listen_fd, &addr, &len);
+        if(fd < 0 || fd >= max_fd) return 1;
+        sock352_setsockopt(fd, SOCK352_OPT_NODELAY, 1);
+        sock352_epoll_event_t event = { SOCK352_EPOLLIN, fd };
+        if(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, fd, &event) < 0) return 1;
+    }
+
+    sock352_epoll_event_t events[MAX_EVENTS];
+    while(1){
+        int n = sock352_epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if(n < 0) return 1;
+        for(i=0;i<n;i++){
+            int fd = events[i].fd;
+            char *buf = bufs + (size_t)fd * size;
+            int rc = sock352_read(fd, buf + got[fd], size - got[fd]);
+            if(rc <= 0){
+                sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_DEL, fd, NULL);
+                continue;
+            }
+            if((got[fd] += rc) < size) continue;
+            got[fd] = 0;
+            if(sock352_write(fd, buf, size) != size) return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * The client: open the idle connections and the active ones, then send
+ * on the active ones for the length of the run -- a connection whose
+ * echo is back waits in a FIFO for its next send time
+ */
+int runClient(int port, int idle, int active, double rate, double seconds, int size, int pipe_fd){
+    sock352_init(port);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int max_fd = idle + active + 64;
+    int *got = calloc(max_fd, sizeof(int));
+    double *sent = calloc(max_fd, sizeof(double));
+    int *active_fds = malloc(active * sizeof(int));
+    int *queue = malloc(active * sizeof(int));
+    double *queue_due = malloc(active * sizeof(double));
+    int head = 0, n_queued = 0;
+    double interval = (rate > 0) ? 1 / rate : 0;
+    char *buf = malloc(size);
+    memset(buf, 'x', size);
+
+    int i=0;
+    for(;i<idle + active;i++){
+        int fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+        if(fd < 0 || fd >= max_fd || sock352_connect(fd, &addr, sizeof(addr)) < 0) return 1;
+        if(i >= idle) active_fds[i - idle] = fd;
+    }
+
+    /*
+     * Each client connection has its own UDP socket, so only the active
+     * ones join the set here (the server holds all of them)
+     */
+    int epfd = sock352_epoll_create(1);
+    if(epfd < 0) return 1;
+    for(i=0;i<active;i++){
+        int fd = active_fds[i];
+        sock352_setsockopt(fd, SOCK352_OPT_NODELAY, 1);
+        sock352_epoll_event_t event = { SOCK352_EPOLLIN, fd };
+        if(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, fd, &event) < 0) return 1;
+    }
+    usleep(500000); /* let the last handshakes settle */
+
+    int max_trips = 1 << 22, trips = 0;
+    double *times = malloc(max_trips * sizeof(double));
+    double waits = 0;
+    sock352_epoll_event_t events[MAX_EVENTS];
+
+    /*
+     * The first sends are spread over one interval
+     */
+    double start = now();
+    for(i=0;i<active;i++){
+        queue[i] = active_fds[i];
+        queue_due[i] = start + interval * i / active;
+    }
+    n_queued = active;
+
+    double t;
+    while((t = now()) - start < seconds){
+        while(n_queued > 0 && queue_due[head] <= t){
+            int fd = queue[head];
+            head = (head + 1) % active;
+            n_queued--;
+            sent[fd] = now();
+            if(sock352_write(fd, buf, size) != size) return 1;
+        }
+
+        int timeout = 1000;
+        if(n_queued > 0) timeout = (int)((queue_due[head] - t) * 1000) + 1;
+
+        int n = sock352_epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if(n < 0) return 1;
+        waits++;
+        for(i=0;i<n;i++){
+            int fd = events[i].fd;
+            int rc = sock352_read(fd, buf, size - got[fd]);
+            if(rc <= 0) return 1;
+            if((got[fd] += rc) < size) continue;
+            got[fd] = 0;
+            double done = now();
+            if(trips < max_trips) times[trips] = done - sent[fd];
+            trips++;
+            int tail = (head + n_queued) % active;
+            queue[tail] = fd;
+            queue_due[tail] = sent[fd] + interval;
+            n_queued++;
+        }
+    }
+
+    struct result result;
+    result.seconds = now() - start;
+    result.trips = trips;
+    result.waits = waits;
+    int kept = (trips < max_trips) ? trips : max_trips;
+    qsort(times, kept, sizeof(double), compareDoubles);
+    result.median = (kept > 0) ? times[kept / 2] : -1;
+    result.p99 = (kept > 0) ? times[(int)(kept * 0.99)] : -1;
+    write(pipe_fd, &result, sizeof(result));
+
+    /*
+     * Exit without closing the connections, the server is killed
+     */
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int idle[MAX_RUNS], n_runs = 0, active = 1000, size = 64, c;
+    double seconds = 3, rate = 10;
+
+    while((c = getopt(argc, argv, "c:a:r:t:b:")) != -1){
+        switch(c){
+            case 'c': if(n_runs < MAX_RUNS) idle[n_runs++] = atoi(optarg); break;
+            case 'a': active = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'b': size = atoi(optarg); break;
+            default:
+                printf("usage: %s [-c idle connections]... [-a active connections] [-r messages/s per connection] [-t seconds] [-b message bytes]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(n_runs == 0){
+        int defaults[] = { 0, 1000, 10000 };
+        for(n_runs=0;n_runs<3;n_runs++) idle[n_runs] = defaults[n_runs];
+    }
+    if(active <= 0) active = 1;
+    if(size <= 0) size = 1;
+
+    /*
+     * Every client connection has its own UDP socket, every connection
+     * in an epoll set its own eventfd
+     */
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    /*
+     * No path MTU probes -- up to 64 KB each, they would keep the idle
+     * connections busy well into the run (set SOCK352_MSS to override)
+     */
+    setenv("SOCK352_MSS", "1472", 0);
+
+    if(rate > 0) printf("%d active connections, %.0f messages/s of %d bytes on each, %.0f s\n", active, rate, size, seconds);
+    else printf("%d active connections, one %d byte message in flight on each, %.0f s\n", active, size, seconds);
+    printf("%8s %12s %12s %12s %14s\n", "idle", "trips/s", "median usec", "p99 usec", "events/wait");
+
+    int port = 22000 + (getpid() % 1000) * 4;
+    int run=0;
+    for(;run<n_runs;run++){
+        int fds[2];
+        if(pipe(fds) < 0) return 1;
+
+        fflush(stdout);
+        pid_t server = fork();
+        if(server == 0) exit(runServer(port, idle[run] + active, size));
+        usleep(100000); /* let the server get to listen */
+        pid_t client = fork();
+        if(client == 0) exit(runClient(port, idle[run], active, rate, seconds, size, fds[1]));
+        close(fds[1]);
+
+        struct result result;
+        int ok = (read(fds[0], &result, sizeof(result)) == sizeof(result));
+        close(fds[0]);
+        waitpid(client, NULL, 0);
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+
+        if(!ok || result.trips == 0) printf("%8d %12s\n", idle[run], "failed");
+        else printf("%8d %12.0f %12.1f %12.1f %14.1f\n", idle[run], result.trips / result.seconds,
+                    result.median * 1e6, result.p99 * 1e6, result.trips / result.waits);
+        port += 2;
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Bulk transfer benchmark for UDP GSO and GRO in CS352 RDP
+ *
+ * For each combination of SOCK352_GSO and SOCK352_GRO a client sends
+ * -n bytes over loopback to a server, which answers with one byte once
+ * it has read them all. Both ends run in their own process (their own
+ * library instance); the benchmark reports the throughput and the CPU
+ * time both ends used per megabyte.
+ *
+ * usage: bench_gso [-n bytes] [-w write size] [-m mss] [-r runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "sock352.h"
+
+/*
+ * Seconds on the monotonic clock
+ */
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Put a SOCK352_* option in the environment, for the library to read at init
+ */
+void setOption(const char *name, int value){
+    char text[16];
+    snprintf(text, sizeof(text), "%d", value);
+    setenv(name, text, 1);
+}
+
+/*
+ * The receiving end: read n bytes, answer with one
+ */
+int runServer(int port, long n){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, 5) < 0) return 1;
+
+    int len = sizeof(addr);
+    int fd = sock352_accept(listen_fd, &addr, &len);
+    if(fd < 0) return 1;
+
+    static char buf[65536];
+    long got = 0;
+    while(got < n){
+        int rc = sock352_read(fd, buf, sizeof(buf));
+        if(rc <= 0) return 1;
+        got += rc;
+    }
+    char done = 1;
+    if(sock352_write(fd, &done, 1) != 1) return 1;
+
+    sock352_close(fd);
+    sock352_close(listen_fd);
+    return 0;
+}
+
+/*
+ * The sending end: write n bytes, wait for the answer, report the time
+ * through the pipe
+ */
+int runClient(int server_port, int local_port, long n, int write_size, int pipe_fd){
+    sock352_init2(server_port, local_port);
+    int fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_connect(fd, &addr, sizeof(addr)) < 0) return 1;
+
+    char *buf = malloc(write_size);
+    memset(buf, 'x', write_size);
+    double start = now();
+    long sent = 0;
+    while(sent < n){
+        int size = (n - sent < write_size) ? (int)(n - sent) : write_size;
+        if(sock352_write(fd, buf, size) != size) return 1;
+        sent += size;
+    }
+    char done;
+    if(sock352_read(fd, &done, 1) != 1) return 1;
+    double elapsed = now() - start;
+
+    write(pipe_fd, &elapsed, sizeof(elapsed));
+    sock352_close(fd);
+    free(buf);
+    return 0;
+}
+
+/*
+ * One transfer with the given options; returns the elapsed time and the
+ * CPU time of both ends, or -1
+ */
+double runOnce(int port, long n, int write_size, int mss, int gso, int gro, double *cpu){
+    int fds[2];
+    if(pipe(fds) < 0) return -1;
+
+    setOption("SOCK352_GSO", gso);
+    setOption("SOCK352_GRO", gro);
+    if(mss > 0) setOption("SOCK352_MSS", mss);
+
+    fflush(stdout);
+    pid_t server = fork();
+    if(server == 0) exit(runServer(port, n));
+    usleep(100000); /* let the server get to listen */
+    pid_t client = fork();
+    if(client == 0) exit(runClient(port, port + 1, n, write_size, fds[1]));
+    close(fds[1]);
+
+    double elapsed = -1;
+    if(read(fds[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) elapsed = -1;
+    close(fds[0]);
+
+    *cpu = 0;
+    pid_t pids[2] = { client, server };
+    int i=0;
+    for(;i<2;i++){
+        int status;
+        struct rusage usage;
+        wait4(pids[i], &status, 0, &usage);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) elapsed = -1;
+        *cpu += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+    }
+    return elapsed;
+}
+
+int main(int argc, char *argv[]){
+    long n = 200000000;
+    int write_size = 65536, mss = 0, runs = 3, c;
+
+    while((c = getopt(argc, argv, "n:w:m:r:")) != -1){
+        switch(c){
+            case 'n': n = atol(optarg); break;
+            case 'w': write_size = atoi(optarg); break;
+            case 'm': mss = atoi(optarg); break;
+            case 'r': runs = atoi(optarg); break;
+            default:
+                printf("usage: %s [-n bytes] [-w write size] [-m mss] [-r runs]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(write_size <= 0) write_size = 1;
+
+    if(mss > 0) printf("%ld bytes, %d byte writes, mss %d, best of %d\n", n, write_size, mss, runs);
+    else printf("%ld bytes, %d byte writes, probed mss, best of %d\n", n, write_size, runs);
+    printf("%-4s %-4s %10s %14s\n", "GSO", "GRO", "MB/s", "CPU ms per MB");
+
+    int port = 21000 + (getpid() % 1000) * 8;
+    int gso=0;
+    for(;gso<2;gso++){
+        int gro=0;
+        for(;gro<2;gro++){
+            double best = -1, best_cpu = 0;
+            int run=0;
+            for(;run<runs;run++){
+                double cpu;
+                double elapsed = runOnce(port, n, write_size, mss, gso, gro, &cpu);
+                port += 2;
+                if(elapsed > 0 && (best < 0 || elapsed < best)){
+                    best = elapsed;
+                    best_cpu = cpu;
+                }
+            }
+            if(best < 0) printf("%-4s %-4s %10s\n", gso ? "on" : "off", gro ? "on" : "off", "failed");
+            else printf("%-4s %-4s %10.1f %14.2f\n", gso ? "on" : "off", gro ? "on" : "off",
+                        n / best / 1e6, best_cpu * 1e3 / (n / 1e6));
+        }
+    }
+    return 0;
+}
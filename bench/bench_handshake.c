@@ -0,0 +1,190 @@
+/*
+ * Handshake storm benchmark for CS352 RDP
+ *
+ * A server accepts -n connections as fast as it can while a raw UDP
+ * client opens them, -w handshakes in flight at a time: each client is
+ * one cs352 source port that sends a SYN and ACKs the SYN|ACK. When
+ * nothing arrives for 200 ms the SYNs still unanswered go out again,
+ * and so do the ACKs (a listener using SYN cookies keeps nothing to
+ * resend if it dropped one). The server runs in its own process and
+ * reports the handshakes it accepted per second and its listener's
+ * handshake counters.
+ *
+ * usage: bench_handshake [-n connections] [-w in flight] [-b listen backlog] [-o NAME=VALUE]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "sock352.h"
+
+#define CLIENT_PORT_BASE 100 /* cs352 source port of the first client */
+
+/*
+ * From the library -- the raw client checksums its packets like it does
+ */
+uint16_t packetChecksum(sock352_pkt_hdr_t *header, size_t len);
+
+/*
+ * What the server reports, in memory shared with the parent
+ */
+struct result{
+    int accepted;
+    double seconds; /* from the first accept to the last */
+    sock352_stats_t stats; /* the listener's */
+};
+
+/*
+ * Seconds on the monotonic clock
+ */
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Send a handshake packet of one raw client
+ */
+void sendHeader(int fd, struct sockaddr_in *to, int flags, uint32_t port, uint64_t seq, uint64_t ack){
+    sock352_pkt_hdr_t header;
+    memset(&header, 0, sizeof(header));
+    header.version = SOCK352_VER_1;
+    header.flags = flags;
+    header.header_len = sizeof(header);
+    header.source_port = port;
+    header.sequence_no = seq;
+    header.ack_no = ack;
+    header.checksum = htons(packetChecksum(&header, sizeof(header)));
+    sendto(fd, &header, sizeof(header), 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/*
+ * The server: accept n connections, keep them open
+ */
+int runServer(int port, int n, int backlog, struct result *result){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, backlog) < 0) return 1;
+
+    double start = 0;
+    int i=0;
+    for(;i<n;i++){
+        int len = sizeof(addr);
+        if(sock352_accept(listen_fd, &addr, &len) < 0) return 1;
+        if(i == 0) start = now();
+    }
+    result->seconds = now() - start;
+    sock352_getstats(listen_fd, &result->stats);
+    result->accepted = n;
+    return 0;
+}
+
+/*
+ * The raw client: n handshakes, in_flight at a time -- it runs until
+ * the server has them all
+ */
+int runClient(int port, int n, int in_flight){
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    char *state = calloc(n, 1); /* 1 SYN sent, 2 SYN|ACK answered */
+    uint64_t *acks = calloc(n, sizeof(uint64_t)); /* what the ACK acknowledged */
+    int sent = 0, pending = 0;
+    while(1){
+        while(pending < in_flight && sent < n){
+            sendHeader(fd, &to, SOCK352_SYN, CLIENT_PORT_BASE + sent, 1000, 0);
+            state[sent++] = 1;
+            pending++;
+        }
+
+        /*
+         * Nothing for a while -- the listener dropped some SYNs or ACKs
+         */
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 200) <= 0){
+            int i=0;
+            for(;i<sent;i++){
+                if(state[i] == 1) sendHeader(fd, &to, SOCK352_SYN, CLIENT_PORT_BASE + i, 1000, 0);
+                else sendHeader(fd, &to, SOCK352_ACK, CLIENT_PORT_BASE + i, 1001, acks[i]);
+            }
+            continue;
+        }
+
+        char buf[65536];
+        int len = recv(fd, buf, sizeof(buf), 0);
+        sock352_pkt_hdr_t *reply = (sock352_pkt_hdr_t *)buf;
+        if(len < (int)sizeof(sock352_pkt_hdr_t) || (reply->flags & (SOCK352_SYN | SOCK352_ACK)) != (SOCK352_SYN | SOCK352_ACK)) continue;
+
+        int i = (int)reply->source_port - CLIENT_PORT_BASE;
+        if(i < 0 || i >= sent) continue;
+        sendHeader(fd, &to, SOCK352_ACK, reply->source_port, 1001, reply->sequence_no + 1);
+        acks[i] = reply->sequence_no + 1;
+        if(state[i] == 1){
+            state[i] = 2;
+            pending--;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int n = 5000, in_flight = 64, backlog = 128, c;
+
+    while((c = getopt(argc, argv, "n:w:b:o:")) != -1){
+        switch(c){
+            case 'n': n = atoi(optarg); break;
+            case 'w': in_flight = atoi(optarg); break;
+            case 'b': backlog = atoi(optarg); break;
+            case 'o': putenv(optarg); break;
+            default:
+                printf("usage: %s [-n connections] [-w in flight] [-b listen backlog] [-o NAME=VALUE]...\n", argv[0]);
+                return 2;
+        }
+    }
+    if(n <= 0) n = 1;
+    if(in_flight <= 0) in_flight = 1;
+
+    struct result *result = mmap(NULL, sizeof(struct result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    memset(result, 0, sizeof(*result));
+
+    int port = 24000 + (getpid() % 1000) * 4;
+    fflush(stdout);
+    pid_t server = fork();
+    if(server == 0) exit(runServer(port, n, backlog, result));
+    usleep(100000); /* let the server get to listen */
+
+    pid_t client = fork();
+    if(client == 0) exit(runClient(port, n, in_flight));
+
+    int status;
+    waitpid(server, &status, 0);
+    kill(client, SIGKILL);
+    waitpid(client, NULL, 0);
+
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || result->accepted != n){
+        printf("failed\n");
+        return 1;
+    }
+    printf("%d connections, %d in flight, backlog %d: %.0f handshakes/s\n", n, in_flight, backlog, (n - 1) / result->seconds);
+    printf("listener: %llu handshakes, %llu SYN drops, %llu timeouts, %llu SYN cookies\n",
+           (unsigned long long)result->stats.handshakes, (unsigned long long)result->stats.syn_drops,
+           (unsigned long long)result->stats.syn_timeouts, (unsigned long long)result->stats.syn_cookies);
+    return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * SYN flood benchmark for CS352 RDP
+ *
+ * For each SOCK352_SYNCOOKIES mode (0 never, 1 once the backlog is
+ * full, 2 always) a server accepts connections for -t seconds while a
+ * flooder sends it SYNs from random cs352 source ports that never ACK,
+ * and a raw UDP client opens real connections, -w handshakes in flight
+ * (unanswered SYNs go out again when nothing arrives for 200 ms). The
+ * server waits on its listener with sock352_epoll_wait, so its counters
+ * stay current without a connection to accept. Reported: the SYNs
+ * flooded, the real connections accepted, the listener's counters and
+ * the server's resident memory.
+ *
+ * usage: bench_synflood [-m cookie mode]... [-t seconds] [-w in flight] [-b listen backlog]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "sock352.h"
+
+#define MAX_RUNS 8
+#define CLIENT_PORT_BASE 100 /* cs352 source port of the first real client */
+#define MAX_CLIENTS 1000000
+#define FLOOD_PORT_BASE 2000000 /* the flood's source ports start here, clear of the real ones */
+
+/*
+ * From the library -- the raw clients checksum their packets like it does
+ */
+uint16_t packetChecksum(sock352_pkt_hdr_t *header, size_t len);
+
+/*
+ * What the processes report, in memory shared with the parent
+ */
+struct result{
+    int accepted; /* real connections accepted */
+    long rss_kb; /* the server's VmRSS */
+    sock352_stats_t stats; /* the listener's */
+    long flooded; /* SYNs the flooder sent */
+};
+
+/*
+ * Seconds on the monotonic clock
+ */
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Send a handshake packet of one raw client
+ */
+void sendHeader(int fd, struct sockaddr_in *to, int flags, uint32_t port, uint64_t seq, uint64_t ack){
+    sock352_pkt_hdr_t header;
+    memset(&header, 0, sizeof(header));
+    header.version = SOCK352_VER_1;
+    header.flags = flags;
+    header.header_len = sizeof(header);
+    header.source_port = port;
+    header.sequence_no = seq;
+    header.ack_no = ack;
+    header.checksum = htons(packetChecksum(&header, sizeof(header)));
+    sendto(fd, &header, sizeof(header), 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/*
+ * Resident memory of this process, from /proc
+ */
+long residentKb(){
+    FILE *status = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = 0;
+    if(status == NULL) return 0;
+    while(fgets(line, sizeof(line), status) != NULL){
+        if(strncmp(line, "VmRSS:", 6) == 0) kb = atol(line + 6);
+    }
+    fclose(status);
+    return kb;
+}
+
+/*
+ * The server: accept whatever completes its handshake, keep the
+ * counters in the shared result up to date
+ */
+int runServer(int port, int backlog, struct result *result){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, backlog) < 0) return 1;
+
+    int epfd = sock352_epoll_create(1);
+    sock352_epoll_event_t event = { SOCK352_EPOLLIN, listen_fd };
+    if(epfd < 0 || sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, listen_fd, &event) < 0) return 1;
+
+    while(1){
+        int n = sock352_epoll_wait(epfd, &event, 1, 100);
+        if(n < 0) return 1;
+        if(n == 1){
+            int len = sizeof(addr);
+            if(sock352_accept(listen_fd, &addr, &len) < 0) return 1;
+            result->accepted++;
+        }
+        sock352_getstats(listen_fd, &result->stats);
+        result->rss_kb = residentKb();
+    }
+    return 0;
+}
+
+/*
+ * The flooder: SYNs from random source ports, until killed
+ */
+int runFlood(int port, struct result *result){
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    unsigned int seed = getpid();
+    while(1){
+        sendHeader(fd, &to, SOCK352_SYN, FLOOD_PORT_BASE + (rand_r(&seed) & 0x3fffffff), rand_r(&seed), 0);
+        result->flooded++;
+    }
+    return 0;
+}
+
+/*
+ * The real clients: one handshake after the other, in_flight at a time,
+ * until killed
+ */
+int runClients(int port, int in_flight){
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    char *state = calloc(MAX_CLIENTS, 1); /* 1 SYN sent, 2 SYN|ACK answered */
+    int sent = 0, pending = 0;
+    while(1){
+        while(pending < in_flight && sent < MAX_CLIENTS){
+            sendHeader(fd, &to, SOCK352_SYN, CLIENT_PORT_BASE + sent, 1000, 0);
+            state[sent++] = 1;
+            pending++;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 200) <= 0){
+            int i=0;
+            for(;i<sent;i++) if(state[i] == 1) sendHeader(fd, &to, SOCK352_SYN, CLIENT_PORT_BASE + i, 1000, 0);
+            continue;
+        }
+
+        char buf[65536];
+        int len = recv(fd, buf, sizeof(buf), 0);
+        sock352_pkt_hdr_t *reply = (sock352_pkt_hdr_t *)buf;
+        if(len < (int)sizeof(sock352_pkt_hdr_t) || (reply->flags & (SOCK352_SYN | SOCK352_ACK)) != (SOCK352_SYN | SOCK352_ACK)) continue;
+
+        int i = (int)reply->source_port - CLIENT_PORT_BASE;
+        if(i < 0 || i >= sent) continue;
+        sendHeader(fd, &to, SOCK352_ACK, reply->source_port, 1001, reply->sequence_no + 1);
+        if(state[i] == 1){
+            state[i] = 2;
+            pending--;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    int modes[MAX_RUNS], n_runs = 0, in_flight = 16, backlog = 128, c;
+    double seconds = 6;
+
+    while((c = getopt(argc, argv, "m:t:w:b:")) != -1){
+        switch(c){
+            case 'm': if(n_runs < MAX_RUNS) modes[n_runs++] = atoi(optarg); break;
+            case 't': seconds = atof(optarg); break;
+            case 'w': in_flight = atoi(optarg); break;
+            case 'b': backlog = atoi(optarg); break;
+            default:
+                printf("usage: %s [-m cookie mode]... [-t seconds] [-w in flight] [-b listen backlog]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(n_runs == 0){
+        for(n_runs=0;n_runs<3;n_runs++) modes[n_runs] = n_runs;
+    }
+    if(in_flight <= 0) in_flight = 1;
+
+    struct result *result = mmap(NULL, sizeof(struct result), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    printf("%.0f s of flood, %d real handshakes in flight, backlog %d\n", seconds, in_flight, backlog);
+    printf("%5s %10s %9s %10s %11s %12s %8s\n", "mode", "flooded", "accepted", "syn drops", "syn cookies", "bad cookies", "RSS KB");
+
+    int port = 26000 + (getpid() % 1000) * 4;
+    int run=0;
+    for(;run<n_runs;run++){
+        memset(result, 0, sizeof(*result));
+        char mode[16];
+        snprintf(mode, sizeof(mode), "%d", modes[run]);
+        setenv("SOCK352_SYNCOOKIES", mode, 1);
+
+        fflush(stdout);
+        pid_t server = fork();
+        if(server == 0) exit(runServer(port, backlog, result));
+        usleep(300000); /* let the server get to listen */
+
+        /*
+         * The flood gets a head start to fill the backlog
+         */
+        pid_t flood = fork();
+        if(flood == 0) exit(runFlood(port, result));
+        usleep(500000);
+        pid_t clients = fork();
+        if(clients == 0) exit(runClients(port, in_flight));
+
+        usleep((useconds_t)(seconds * 1e6));
+        kill(clients, SIGKILL);
+        kill(flood, SIGKILL);
+        usleep(200000); /* the server's counters catch up */
+        kill(server, SIGKILL);
+        waitpid(clients, NULL, 0);
+        waitpid(flood, NULL, 0);
+        waitpid(server, NULL, 0);
+
+        printf("%5d %10ld %9d %10llu %11llu %12llu %8ld\n", modes[run], result->flooded, result->accepted,
+               (unsigned long long)result->stats.syn_drops, (unsigned long long)result->stats.syn_cookies,
+               (unsigned long long)result->stats.bad_cookies, result->rss_kb);
+        port += 2;
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "sock352.h"
+
+/*
+ * Packet checksums for CS352 RDP
+ *
+ * Every datagram carries a CRC32C (Castagnoli) of its header, options
+ * and payload, taken with the checksum field zeroed and folded into the
+ * 16 bits of the field. CPUs with SSE4.2 compute it with the crc32
+ * instruction, others with a table driven version. The implementation
+ * is picked the first time a checksum is needed.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+
+uint32_t crc32c_table[8][256]; /* slicing-by-8 tables */
+uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *data, size_t len); /* the implementation in use */
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+/* Table driven (any CPU) */
+
+/*
+ * CRC32C eight bytes at a time with the slicing-by-8 tables
+ */
+uint32_t crc32cTable(uint32_t crc, const unsigned char *data, size_t len){
+    while(len > 0 && ((uintptr_t)data & 7) != 0){
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(len >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        data += 8;
+        len -= 8;
+    }
+#endif
+
+    while(len > 0){
+        crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+
+/* SSE4.2 */
+
+#ifdef CRC32C_HAVE_SSE42
+/*
+ * CRC32C with the crc32 instruction, eight bytes at a time
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t len){
+    while(len > 0 && ((uintptr_t)data & 7) != 0){
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while(len >= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+
+    while(len >= 4){
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+        data += 4;
+        len -= 4;
+    }
+
+    while(len > 0){
+        crc = _mm_crc32_u8(crc, *data++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+
+/* Dispatch */
+
+/*
+ * Build the tables and pick the fastest implementation this CPU runs
+ */
+void initCrc32c(){
+    int i=0;
+    for(;i<256;i++){
+        uint32_t crc = i;
+        int bit=0;
+        for(;bit<8;bit++) crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for(i=0;i<256;i++){
+        int k=1;
+        for(;k<8;k++) crc32c_table[k][i] = crc32c_table[0][crc32c_table[k - 1][i] & 0xff] ^ (crc32c_table[k - 1][i] >> 8);
+    }
+
+    crc32c_impl = crc32cTable;
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) crc32c_impl = crc32cSse42;
+#endif
+}
+
+/*
+ * CRC32C of a buffer
+ */
+uint32_t crc32c(const void *data, size_t len){
+    pthread_once(&crc32c_once, initCrc32c);
+    return ~crc32c_impl(~0U, (const unsigned char *)data, len);
+}
+
+/*
+ * Checksum of a datagram of len bytes (starting with its header) for
+ * the 16-bit checksum field -- the field itself counts as zero
+ */
+uint16_t packetChecksum(sock352_pkt_hdr_t *header, size_t len){
+    uint16_t saved = header->checksum;
+    header->checksum = 0;
+    uint32_t crc = crc32c(header, len);
+    header->checksum = saved;
+
+    return (uint16_t)((crc >> 16) ^ (crc & 0xffff));
+}
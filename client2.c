@@ -52,12 +52,12 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <openssl/md5.h>
 
 #include "sock352.h"
 
 #define BUFFER_SIZE 8192
-#define MAX_ZERO_BYTE_READS 1000000
 
 void usage() {
 		printf("client2: usage: -f <remote filename>  -o <output file> -d <destination> -u <udp-port> -l <local-port> -r <remote-port> \n");
@@ -103,7 +103,8 @@ int main(int argc, char *argv[], char *envp[]) {
 	int command_len, protocol_len,filename_len; /* lengths of the command and protocol strings */
 	char *server_command_s; /* string to send to the server with the command name, filename and protocol name */
 
-	int end_of_file, total_bytes, bytes_read,zero_bytes,socket_closed;
+	int end_of_file, total_bytes, bytes_read;
+	char *file_map;           /* the output file mapped for the checksum */
 	int bw;                   /* bytes written */
 	struct timeval begin_time, end_time; /* start, end time to compute bandwidth */
 	uint64_t lapsed_useconds;   /* micro-seconds since epoch */
@@ -170,8 +171,8 @@ int main(int argc, char *argv[], char *envp[]) {
 		exit(-1);
 	}
 
-	/* open the local file for writing  */
-	if ( (output_fd = open(output_filename,O_CREAT|O_WRONLY) ) < 0) {
+	/* open the local file for writing (and reading, the library maps it) */
+	if ( (output_fd = open(output_filename,O_CREAT|O_RDWR) ) < 0) {
 		printf("client2: error: open of output file %s failed: %s \n", output_filename,
 			strerror(errno));
 		exit(-1);
@@ -236,45 +237,31 @@ int main(int argc, char *argv[], char *envp[]) {
 	MD5_Init(&md5_context);
 	gettimeofday(&begin_time, (struct timezone *) NULL); /* get a start timestamp */
 
-	if ( sock352_connect(dest_sock, &dest_addr, sizeof(dest_addr)) != SOCK352_SUCCESS) {
+	/* connect and send the name of the file in the SYN */
+	if ( sock352_connect_with_data(dest_sock, &dest_addr, sizeof(dest_addr),buffer,strlen(buffer)) != SOCK352_SUCCESS) {
 		printf("client2: connect failed");
 		exit(-1);
 	}
 
-	/* write the name of the file */
-	sock352_write(dest_sock,buffer,strlen(buffer));
-
 	/* read the size of the file*/
 	sock352_read(dest_sock,&file_size_network,sizeof(file_size_network));
 	file_size = htonl((int) file_size_network);
 
-	total_bytes = zero_bytes = socket_closed = 0;
-	/* loop until we either get the whole file or there is an error */
-	while ( (total_bytes < file_size) && (! socket_closed)) {
-		bytes_read = sock352_read(dest_sock,buffer,BUFFER_SIZE);
+	/* receive the file straight into the output file, until we get the whole file or there is an error */
+	total_bytes = 0;
+	if (file_size > 0) {
+		if ( (bytes_read = sock352_recvfile(dest_sock,output_fd,file_size)) != file_size) {
+			printf("client2: error receiving the file, bytes received %d \n", bytes_read);
+		}
 		if (bytes_read > 0) {
-			total_bytes += bytes_read;
-				bw = write(output_fd,buffer,bytes_read);
-				if (bw != bytes_read) {
-					printf("client2: error writing to file at byte %d \n", total_bytes);
-				} else {
-					MD5_Update(&md5_context, buffer, bytes_read);
-				}
-		} else {
-			if (bytes_read == 0) {
-				zero_bytes++;
-			} else {
-				if (bytes_read < 0 ){
-					socket_closed = 1;
-				}
+			total_bytes = bytes_read;
+			/* checksum what was received */
+			if ( (file_map = mmap(NULL,total_bytes,PROT_READ,MAP_SHARED,output_fd,0)) != MAP_FAILED) {
+				MD5_Update(&md5_context, file_map, total_bytes);
+				munmap(file_map,total_bytes);
 			}
 		}
-		if (zero_bytes > MAX_ZERO_BYTE_READS) {
-			printf("server: too many zero byte returns, closing connection\n");
-			socket_closed = 1;
-		}
-	} /* end while socket not closed */
-	if ( zero_bytes > 0) printf("client2: zero byte calls is %d \n",zero_bytes);
+	}
 	sock352_close(dest_sock);
 	gettimeofday(&end_time, (struct timezone *) NULL); /* end time-stamp */
 	MD5_Final(md5_out, &md5_context);
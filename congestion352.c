@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "sock352.h"
+
+/*
+ * Congestion control for CS352 RDP
+ *
+ * Each connection has a congestion352_t holding the congestion window
+ * (in packets) and a pointer to the algorithm that drives it. The
+ * algorithm is called back when packets are ACKed, when a loss is
+ * detected from SACKs and when the retransmission timer fires.
+ */
+
+#define CC_INITIAL_WINDOW 10 /* packets */
+#define CC_MIN_WINDOW 2 /* packets */
+#define CC_INITIAL_SSTHRESH 1e9 /* effectively no slow start threshold */
+
+#define CUBIC_C 0.4 /* scaling constant (RFC 8312) */
+#define CUBIC_BETA 0.7 /* multiplicative decrease factor (RFC 8312) */
+
+struct cc_algorithm;
+
+/*
+ * Congestion control state of a connection
+ */
+struct congestion352{
+    const struct cc_algorithm *algorithm; /* the algorithm in use */
+    double cwnd; /* congestion window (packets) */
+    double ssthresh; /* slow start threshold (packets) */
+    double w_max; /* cubic - window before the last reduction */
+    double w_last_max; /* cubic - w_max before the last reduction (fast convergence) */
+    double w_est; /* cubic - estimate of a standard TCP window (TCP-friendly region) */
+    double k; /* cubic - seconds the cubic function takes to get back to w_max */
+    uint64_t epoch_start; /* cubic - start of the current congestion avoidance epoch (usec), 0 if none */
+};
+
+typedef struct congestion352 congestion352_t;
+
+/*
+ * Congestion control algorithm callbacks
+ */
+struct cc_algorithm{
+    int id; /* SOCK352_CC_* */
+    const char *name; /* name used in the SOCK352_CC environment variable */
+    void (*init)(congestion352_t *cc);
+    void (*on_ack)(congestion352_t *cc, int acked, uint64_t srtt, uint64_t now); /* acked = newly delivered packets */
+    void (*on_loss)(congestion352_t *cc, uint64_t now); /* once per window with losses */
+    void (*on_rto)(congestion352_t *cc); /* first expiry of the retransmission timer */
+};
+
+typedef struct cc_algorithm cc_algorithm_t;
+
+
+/* Shared helpers */
+
+/*
+ * Reset the window to the initial state
+ */
+void ccInit(congestion352_t *cc){
+    cc->cwnd = CC_INITIAL_WINDOW;
+    cc->ssthresh = CC_INITIAL_SSTHRESH;
+    cc->w_max = 0;
+    cc->w_last_max = 0;
+    cc->w_est = 0;
+    cc->k = 0;
+    cc->epoch_start = 0;
+}
+
+/*
+ * Slow start -- one packet of growth per packet ACKed
+ * returns the number of ACKed packets left over for congestion avoidance
+ */
+int ccSlowStart(congestion352_t *cc, int acked){
+    if(cc->cwnd >= cc->ssthresh) return acked;
+
+    double cwnd = cc->cwnd + acked;
+    if(cwnd > cc->ssthresh){
+        acked = (int)(cwnd - cc->ssthresh);
+        cwnd = cc->ssthresh;
+    }
+    else acked = 0;
+
+    cc->cwnd = cwnd;
+    return acked;
+}
+
+
+/* NewReno (RFC 5681, RFC 6582) */
+
+void newrenoOnAck(congestion352_t *cc, int acked, uint64_t srtt, uint64_t now){
+    acked = ccSlowStart(cc, acked);
+
+    /*
+     * Congestion avoidance -- one packet per window of ACKs
+     */
+    if(acked > 0) cc->cwnd += (double)acked / cc->cwnd;
+}
+
+void newrenoOnLoss(congestion352_t *cc, uint64_t now){
+    cc->ssthresh = cc->cwnd / 2;
+    if(cc->ssthresh < CC_MIN_WINDOW) cc->ssthresh = CC_MIN_WINDOW;
+    cc->cwnd = cc->ssthresh;
+}
+
+void newrenoOnRto(congestion352_t *cc){
+    cc->ssthresh = cc->cwnd / 2;
+    if(cc->ssthresh < CC_MIN_WINDOW) cc->ssthresh = CC_MIN_WINDOW;
+    cc->cwnd = 1;
+}
+
+
+/* CUBIC (RFC 8312) */
+
+void cubicOnAck(congestion352_t *cc, int acked, uint64_t srtt, uint64_t now){
+    acked = ccSlowStart(cc, acked);
+    if(acked == 0) return;
+
+    /*
+     * Start of a congestion avoidance epoch
+     */
+    if(cc->epoch_start == 0){
+        cc->epoch_start = now;
+        if(cc->cwnd < cc->w_max){
+            cc->k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+        }
+        else{
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        }
+        cc->w_est = cc->cwnd;
+    }
+
+    /*
+     * Where the cubic function wants the window one RTT from now
+     */
+    double t = (double)(now - cc->epoch_start + srtt) / 1000000;
+    double target = CUBIC_C * pow(t - cc->k, 3) + cc->w_max;
+
+    /*
+     * TCP-friendly region -- never grow slower than standard TCP would
+     */
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (double)acked / cc->cwnd;
+    if(target < cc->w_est) target = cc->w_est;
+
+    if(target > cc->cwnd) cc->cwnd += (target - cc->cwnd) / cc->cwnd * acked;
+    else cc->cwnd += 0.01 * acked / cc->cwnd;
+}
+
+void cubicOnLoss(congestion352_t *cc, uint64_t now){
+    cc->epoch_start = 0;
+
+    /*
+     * Fast convergence -- release bandwidth to newer flows
+     */
+    if(cc->cwnd < cc->w_last_max) cc->w_max = cc->cwnd * (1 + CUBIC_BETA) / 2;
+    else cc->w_max = cc->cwnd;
+    cc->w_last_max = cc->cwnd;
+
+    cc->cwnd *= CUBIC_BETA;
+    if(cc->cwnd < CC_MIN_WINDOW) cc->cwnd = CC_MIN_WINDOW;
+    cc->ssthresh = cc->cwnd;
+}
+
+void cubicOnRto(congestion352_t *cc){
+    cubicOnLoss(cc, 0);
+    cc->cwnd = 1;
+}
+
+
+/* Algorithm table */
+
+const cc_algorithm_t cc_algorithms[] = {
+    { SOCK352_CC_NEWRENO, "newreno", ccInit, newrenoOnAck, newrenoOnLoss, newrenoOnRto },
+    { SOCK352_CC_CUBIC, "cubic", ccInit, cubicOnAck, cubicOnLoss, cubicOnRto },
+};
+
+#define CC_DEFAULT_ALGORITHM (&cc_algorithms[1])
+
+/*
+ * Find an algorithm by its id, NULL if unknown
+ */
+const cc_algorithm_t * findCcAlgorithm(int id){
+    int i=0;
+    for(;i<sizeof(cc_algorithms)/sizeof(cc_algorithms[0]);i++){
+        if(cc_algorithms[i].id == id) return &cc_algorithms[i];
+    }
+    return NULL;
+}
+
+/*
+ * Find an algorithm by its name, NULL if unknown
+ */
+const cc_algorithm_t * findCcAlgorithmByName(const char *name){
+    int i=0;
+    for(;i<sizeof(cc_algorithms)/sizeof(cc_algorithms[0]);i++){
+        if(strcmp(cc_algorithms[i].name, name) == 0) return &cc_algorithms[i];
+    }
+    return NULL;
+}
+
+/*
+ * Switch a connection to an algorithm, starting from the initial window
+ */
+void setCcAlgorithm(congestion352_t *cc, const cc_algorithm_t *algorithm){
+    cc->algorithm = algorithm;
+    algorithm->init(cc);
+}
@@ -0,0 +1,516 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+/*
+ * Protocol engine for CS352 RDP
+ *
+ * One thread per library instance owns the UDP sockets of all the
+ * established connections and listeners. A pass only touches the
+ * connections that need it: the ones epoll reports packets on, the ones
+ * whose deadline is at the top of the timer heap and the ones the app
+ * put on the wake list (new data to send, a FIN, an option change). It
+ * receives and ACKs packets, runs the
+ * retransmission and pacing timers and moves data from the send buffers
+ * into the network. sock352_read/sock352_write only copy to and from
+ * the per-socket queues and wait on the socket's condition variable, so
+ * the app's file I/O overlaps with the network I/O.
+ *
+ * The connections a server accepts share the listener's UDP socket: the
+ * engine receives on the listener and routes each packet to its
+ * connection through the listener's demux table.
+ *
+ * The engine mutex is only held to pick the connections for a pass,
+ * they are processed after it is released -- the app can add and remove
+ * connections meanwhile, engineRemove waits only if the engine is busy
+ * with that connection.
+ *
+ * Lock order: the engine mutex before any socket mutex, the timer heap
+ * and wake list mutexes last (never both).
+ */
+
+#define ENGINE_RECV_BUDGET 4 /* receive batches drained from one socket per pass */
+#define ENGINE_MAX_EVENTS 256 /* epoll events taken per pass (the rest are reported again) */
+
+struct engine352{
+    int running; /* the engine thread was started */
+    pthread_t thread; /* the engine thread */
+    pthread_mutex_t mutex; /* protects the epoll set and the connections' engine fields */
+    pthread_cond_t idle; /* signaled when the engine is done with a connection it processed */
+    pthread_mutex_t timer_mutex; /* protects the timer heap */
+    socket352_t **timers; /* min-heap of the connections' deadlines */
+    int n_timers; /* number of connections in the heap */
+    int max_timers; /* allocated size of the heap */
+    socket352_t **due; /* connections picked for the current pass */
+    int n_due; /* number of connections picked */
+    int max_due; /* allocated size of the due list */
+    pthread_mutex_t wake_mutex; /* protects the wake list */
+    socket352_t *woken; /* connections the app changed since the last pass */
+    int generation; /* bumped whenever a connection is added or removed */
+    int n_sockets; /* connections and listeners handed to the engine */
+    int wakeup[2]; /* pipe that wakes the engine out of ppoll */
+    int epoll_fd; /* epoll set of the connections' UDP sockets */
+};
+
+typedef struct engine352 engine352_t;
+
+engine352_t engine = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, { -1, -1 }, -1 };
+
+/*
+ * Wake the engine up so it looks at the sockets again
+ */
+int wakeEngine(){
+    char c = 0;
+    if(write(engine.wakeup[1], &c, 1) < 0 && errno != EAGAIN){
+        printf("Failed to wake the engine in wakeEngine(): %s\n", strerror(errno));
+        return SOCK352_FAILURE;
+    }
+    return SOCK352_SUCCESS;
+}
+
+/*
+ * Have the engine look at one connection on its next pass
+ * (the app changed something the engine acts on)
+ */
+int wakeSocket(socket352_t *socket){
+    pthread_mutex_lock(&engine.wake_mutex);
+    int woken = socket->is_woken;
+    if(!woken){
+        socket->is_woken = 1;
+        socket->wake_next = engine.woken;
+        engine.woken = socket;
+    }
+    pthread_mutex_unlock(&engine.wake_mutex);
+
+    /*
+     * Already on the list -- the engine was woken then
+     */
+    return woken ? SOCK352_SUCCESS : wakeEngine();
+}
+
+/*
+ * Swap two entries of the timer heap
+ */
+void swapTimers(int i, int j){
+    socket352_t *socket = engine.timers[i];
+    engine.timers[i] = engine.timers[j];
+    engine.timers[i]->timer_index = i;
+    engine.timers[j] = socket;
+    socket->timer_index = j;
+}
+
+/*
+ * Move a timer heap entry up or down to its place
+ */
+void fixTimer(int i){
+    while(i > 0 && engine.timers[i]->timer_deadline < engine.timers[(i - 1) / 2]->timer_deadline){
+        swapTimers(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+
+    while(1){
+        int child = 2 * i + 1;
+        if(child >= engine.n_timers) break;
+        if(child + 1 < engine.n_timers && engine.timers[child + 1]->timer_deadline < engine.timers[child]->timer_deadline) child++;
+        if(engine.timers[i]->timer_deadline <= engine.timers[child]->timer_deadline) break;
+        swapTimers(i, child);
+        i = child;
+    }
+}
+
+/*
+ * Set when the engine next needs a connection (0 for not until a packet
+ * arrives or the app wakes it)
+ * called with the timer heap mutex held
+ */
+int setTimer(socket352_t *socket, uint64_t deadline){
+    int i = socket->timer_index;
+
+    if(deadline == 0){
+        if(i < 0) return SOCK352_SUCCESS;
+        engine.n_timers--;
+        if(i < engine.n_timers){
+            engine.timers[i] = engine.timers[engine.n_timers];
+            engine.timers[i]->timer_index = i;
+            fixTimer(i);
+        }
+        socket->timer_index = -1;
+        return SOCK352_SUCCESS;
+    }
+
+    if(i < 0){
+        if(engine.n_timers == engine.max_timers){
+            engine.max_timers = (engine.max_timers == 0) ? 16 : engine.max_timers * 2;
+            engine.timers = (socket352_t **)realloc(engine.timers, engine.max_timers * sizeof(socket352_t *));
+        }
+        i = engine.n_timers++;
+        engine.timers[i] = socket;
+        socket->timer_index = i;
+    }
+    socket->timer_deadline = deadline;
+    fixTimer(i);
+
+    return SOCK352_SUCCESS;
+}
+
+/*
+ * Put a connection's next deadline in the timer heap
+ * called with the socket locked
+ */
+int updateTimer(socket352_t *socket){
+    uint64_t deadline = socket->error ? 0 : nextDeadline(socket);
+
+    pthread_mutex_lock(&engine.timer_mutex);
+    setTimer(socket, deadline);
+    pthread_mutex_unlock(&engine.timer_mutex);
+
+    return SOCK352_SUCCESS;
+}
+
+/*
+ * Pick a connection for the current pass (once)
+ * called with the engine mutex held
+ */
+int addDue(socket352_t *socket){
+    if(socket->is_due) return SOCK352_SUCCESS;
+
+    if(engine.n_due == engine.max_due){
+        engine.max_due = (engine.max_due == 0) ? 16 : engine.max_due * 2;
+        engine.due = (socket352_t **)realloc(engine.due, engine.max_due * sizeof(socket352_t *));
+    }
+    socket->is_due = 1;
+    engine.due[engine.n_due++] = socket;
+
+    return SOCK352_SUCCESS;
+}
+
+int engineProcess(socket352_t *socket, uint32_t revents);
+
+/*
+ * A listener passed packets on to its connections -- let each of them ACK
+ * and send what the packets allow (a connection leaves the demux table
+ * under the listener lock before it leaves the engine, so it is still
+ * there)
+ * called with the listener locked
+ */
+int engineRouted(socket352_t *listener){
+    int i=0;
+    for(;i<listener->n_routed;i++){
+        socket352_t *client = listener->routed[i];
+        lockSocket(client);
+        client->is_routed = 0;
+        if(!client->error) engineProcess(client, 0);
+        if(client->in_engine) updateTimer(client);
+        unlockSocket(client);
+    }
+    listener->n_routed = 0;
+
+    return SOCK352_SUCCESS;
+}
+
+/*
+ * Process everything that is due on one connection
+ * called with the socket locked
+ */
+int engineProcess(socket352_t *socket, uint32_t revents){
+    int rc = 0;
+
+    /*
+     * Drain what arrived in batches (each batch with data is ACKed once)
+     */
+    if(revents & EPOLLIN){
+        int i=0;
+        for(;i<ENGINE_RECV_BUDGET && rc >= 0;i++){
+            rc = receiveBatch(socket);
+            engineRouted(socket);
+            if(rc <= 0) break;
+        }
+    }
+
+    /*
+     * ACK what the listener routed to us
+     */
+    if(rc >= 0) rc = finishBatch(socket);
+
+    /*
+     * A listener gives up on clients that never finished the handshake
+     */
+    if(socket->state == LISTEN) expireHandshakes(socket);
+
+    /*
+     * Timers
+     */
+    if(rc >= 0 && socket->rto_deadline != 0 && nowUsec() >= socket->rto_deadline){
+        rc = handleTimeout(socket);
+    }
+
+    /*
+     * Probe the path for a larger MSS
+     */
+    if(rc >= 0 && socket->probe_deadline != 0 && nowUsec() >= socket->probe_deadline) rc = probeMtu(socket);
+
+    /*
+     * Fill the window from the send buffer
+     */
+    if(rc >= 0) rc = sendQueued(socket);
+
+    /*
+     * Everything sent in this pass goes out in one sendmmsg
+     */
+    if(flushBatch(socket) < 0) rc = SOCK352_FAILURE;
+
+    if(rc < 0) socket->error = 1;
+
+    /*
+     * Let the app see the progress
+     */
+    signalSocket(socket);
+
+    return rc;
+}
+
+/*
+ * The engine thread
+ */
+void * engineLoop(void *arg){
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    struct pollfd pfds[2];
+
+    while(1){
+        /*
+         * The earliest timer is at the top of the heap
+         */
+        pthread_mutex_lock(&engine.mutex);
+        int generation = engine.generation;
+        pthread_mutex_unlock(&engine.mutex);
+
+        pthread_mutex_lock(&engine.timer_mutex);
+        uint64_t deadline = (engine.n_timers > 0) ? engine.timers[0]->timer_deadline : 0;
+        pthread_mutex_unlock(&engine.timer_mutex);
+
+        /*
+         * Sleep until a packet arrives, a timer fires or the app wakes us
+         * (ppoll for the usec timeout, the epoll set says which sockets)
+         */
+        struct timespec ts, *timeout = NULL;
+        if(deadline != 0){
+            uint64_t now = nowUsec();
+            uint64_t wait = (deadline > now) ? deadline - now : 0;
+            ts.tv_sec = wait / 1000000;
+            ts.tv_nsec = (wait % 1000000) * 1000;
+            timeout = &ts;
+        }
+
+        pfds[0].fd = engine.wakeup[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = engine.epoll_fd;
+        pfds[1].events = POLLIN;
+
+        if(ppoll(pfds, 2, timeout, NULL) < 0){
+            if(errno == EINTR) continue;
+            printf("Failed to poll in engineLoop(): %s\n", strerror(errno));
+            continue;
+        }
+
+        if(pfds[0].revents & POLLIN){
+            char buf[64];
+            while(read(engine.wakeup[0], buf, sizeof(buf)) > 0);
+        }
+
+        int n = 0;
+        if((pfds[1].revents & POLLIN) && (n = epoll_wait(engine.epoll_fd, events, ENGINE_MAX_EVENTS, 0)) < 0){
+            if(errno != EINTR) printf("Failed to read the epoll set in engineLoop(): %s\n", strerror(errno));
+            n = 0;
+        }
+
+        pthread_mutex_lock(&engine.mutex);
+
+        /*
+         * The connections with packets waiting -- skip them if a
+         * connection was added or removed while we slept (the socket may
+         * be gone), epoll reports them again on the next pass
+         */
+        int i=0;
+        if(generation == engine.generation){
+            for(;i<n;i++){
+                socket352_t *socket = (socket352_t *)events[i].data.ptr;
+                socket->revents = events[i].events;
+                addDue(socket);
+            }
+        }
+
+        /*
+         * The connections the app woke
+         */
+        pthread_mutex_lock(&engine.wake_mutex);
+        socket352_t *woken = engine.woken;
+        engine.woken = NULL;
+        for(;woken != NULL;woken = woken->wake_next){
+            woken->is_woken = 0;
+            if(woken->in_engine) addDue(woken);
+        }
+        pthread_mutex_unlock(&engine.wake_mutex);
+
+        /*
+         * The connections whose timer is due
+         */
+        uint64_t now = nowUsec();
+        pthread_mutex_lock(&engine.timer_mutex);
+        while(engine.n_timers > 0 && engine.timers[0]->timer_deadline <= now){
+            socket352_t *socket = engine.timers[0];
+            setTimer(socket, 0);
+            addDue(socket);
+        }
+        pthread_mutex_unlock(&engine.timer_mutex);
+
+        for(i=0;i<engine.n_due;i++) engine.due[i]->is_busy = 1;
+
+        pthread_mutex_unlock(&engine.mutex);
+
+        /*
+         * Process them and put each back in the heap for its next
+         * deadline -- they stay in the engine until we let go of them
+         */
+        for(i=0;i<engine.n_due;i++){
+            socket352_t *socket = engine.due[i];
+            lockSocket(socket);
+            if(!socket->error) engineProcess(socket, socket->revents);
+            socket->revents = 0;
+            socket->is_due = 0;
+            updateTimer(socket);
+            unlockSocket(socket);
+
+            pthread_mutex_lock(&engine.mutex);
+            socket->is_busy = 0;
+            pthread_cond_broadcast(&engine.idle);
+            pthread_mutex_unlock(&engine.mutex);
+        }
+        engine.n_due = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the engine thread (once per library instance)
+ * called with the engine mutex held
+ */
+int startEngine(){
+    if(engine.running) return SOCK352_SUCCESS;
+
+    if(pipe(engine.wakeup) < 0){
+        printf("Failed to create the wakeup pipe in startEngine(): %s\n", strerror(errno));
+        return SOCK352_FAILURE;
+    }
+    fcntl(engine.wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(engine.wakeup[1], F_SETFL, O_NONBLOCK);
+
+    if((engine.epoll_fd = epoll_create1(0)) < 0){
+        printf("Failed to create the epoll set in startEngine(): %s\n", strerror(errno));
+        return SOCK352_FAILURE;
+    }
+
+    if(pthread_create(&engine.thread, NULL, engineLoop, NULL) != 0){
+        printf("Failed to start the engine thread in startEngine()\n");
+        return SOCK352_FAILURE;
+    }
+    pthread_detach(engine.thread);
+
+    engine.running = 1;
+    return SOCK352_SUCCESS;
+}
+
+/*
+ * Hand an established connection over to the engine
+ */
+int engineAdd(socket352_t *socket){
+    pthread_mutex_lock(&engine.mutex);
+
+    if(startEngine() < 0){
+        pthread_mutex_unlock(&engine.mutex);
+        return SOCK352_FAILURE;
+    }
+
+    /*
+     * A connection sharing its listener's UDP socket gets its packets
+     * through the listener
+     */
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = socket;
+    if(socket->listener == NULL && epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, socket->sock_fd, &event) < 0){
+        printf("Failed to add the socket to the epoll set in engineAdd(): %s\n", strerror(errno));
+        pthread_mutex_unlock(&engine.mutex);
+        return SOCK352_FAILURE;
+    }
+
+    /*
+     * Due at once, so the first pass sends what is queued and sets its timers
+     */
+    lockSocket(socket);
+    socket->in_engine = 1;
+    unlockSocket(socket);
+    pthread_mutex_lock(&engine.timer_mutex);
+    setTimer(socket, 1);
+    pthread_mutex_unlock(&engine.timer_mutex);
+    engine.generation++;
+    engine.n_sockets++;
+
+    pthread_mutex_unlock(&engine.mutex);
+
+    return wakeEngine();
+}
+
+/*
+ * Whether the engine has no connections or listeners left
+ */
+int engineIdle(){
+    pthread_mutex_lock(&engine.mutex);
+    int idle = (engine.n_sockets == 0);
+    pthread_mutex_unlock(&engine.mutex);
+    return idle;
+}
+
+/*
+ * Take a connection away from the engine -- once this returns the
+ * engine no longer touches it
+ * must not be called with the socket locked
+ */
+int engineRemove(socket352_t *socket){
+    pthread_mutex_lock(&engine.mutex);
+
+    /*
+     * The engine may be processing it right now
+     */
+    while(socket->is_busy) pthread_cond_wait(&engine.idle, &engine.mutex);
+
+    if(socket->in_engine){
+        if(socket->listener == NULL) epoll_ctl(engine.epoll_fd, EPOLL_CTL_DEL, socket->sock_fd, NULL);
+        pthread_mutex_lock(&engine.timer_mutex);
+        setTimer(socket, 0);
+        pthread_mutex_unlock(&engine.timer_mutex);
+        lockSocket(socket);
+        socket->in_engine = 0;
+        unlockSocket(socket);
+        engine.generation++;
+        engine.n_sockets--;
+    }
+
+    /*
+     * Off the wake list
+     */
+    pthread_mutex_lock(&engine.wake_mutex);
+    if(socket->is_woken){
+        socket352_t **link = &engine.woken;
+        while(*link != socket) link = &(*link)->wake_next;
+        *link = socket->wake_next;
+        socket->is_woken = 0;
+    }
+    pthread_mutex_unlock(&engine.wake_mutex);
+
+    pthread_mutex_unlock(&engine.mutex);
+
+    return wakeEngine();
+}
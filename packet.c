@@ -5,14 +5,26 @@
 #include <errno.h>
 
 #define MAX_UDP_PACKET_SIZE 64000
-#define MAX_DATA_SIZE 8192
+#define MAX_DATA_SIZE (MAX_UDP_PACKET_SIZE - sizeof(sock352_pkt_hdr_t)) /* largest payload (the connection's MSS decides what is used) */
 
+/* 
+ * The header and the payload are what goes on the wire -- they come last 
+ * so a packet only touches the pages its payload needs 
+ */
 struct packet{
-    sock352_pkt_hdr_t header; 
-    char data[MAX_DATA_SIZE];
+    uint32_t touched; /* most header and payload bytes any use wrote -- kept across reuse by the pool */
     uint32_t size;
+    uint64_t queued_usec; /* time the packet was queued by the app */
+    uint64_t sent_usec; /* time the packet was last (re)transmitted */
+    int retransmits; /* number of times the packet was retransmitted */
+    int sacked; /* the other side selectively acknowledged this packet */
+    int lost; /* considered lost and waiting for the window to be resent */
+    int fast_retransmitted; /* resent as a SACK hole since the last timeout */
+    int batched; /* waiting in the socket's send batch */
     struct packet *next; 
     struct packet *prev; 
+    sock352_pkt_hdr_t header; 
+    char data[MAX_DATA_SIZE];
 }; 
 
 typedef struct packet packet_t; 
\ No newline at end of file
@@ -50,12 +50,11 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <openssl/md5.h>
 
 #include "sock352.h"
 
-#define BUFFER_SIZE 65536
-#define MAX_ZERO_BYTE_READS 1000000
 
 void usage() {
 		printf("server: usage: -o <output-file> -u <udp-port> -l <local-port> -r <remote-port> \n");
@@ -90,11 +89,9 @@ int main(int argc, char *argv[], char *envp) {
 		int retval;  /* return code */
 		int listen_fd, connection_fd;
 
-		char buffer[BUFFER_SIZE]; /* read/write buffer */
+		char *file_map; /* the output file mapped for the checksum */
 		int end_of_file, total_bytes, bytes_read; /* for reading the input file */
 		int client_addr_len;
-		int socket_closed;
-		int zero_bytes,bw;
 		struct timeval begin_time, end_time; /* start, end time to compute bandwidth */
 		uint64_t lapsed_useconds;
 		double lapsed_seconds;
@@ -144,8 +141,8 @@ int main(int argc, char *argv[], char *envp) {
 				usage();
 				exit(-1);
 		}
-		/* open the file for writing  */
-		if ( (file_fd = open(output_filename,O_CREAT|O_WRONLY) ) < 0) {
+		/* open the file for writing (and reading, the library maps it) */
+		if ( (file_fd = open(output_filename,O_CREAT|O_RDWR) ) < 0) {
 			printf("server: error: open of file %s failed: %s \n", output_filename,
 				strerror(errno));
 			exit(-1);
@@ -194,7 +191,7 @@ int main(int argc, char *argv[], char *envp) {
 			exit(-1);
 		}
 
-		socket_closed = zero_bytes = total_bytes = 0;
+		total_bytes = 0;
 		MD5_Init(&md5_context);
 		gettimeofday(&begin_time, (struct timezone *) NULL);
 
@@ -206,34 +203,20 @@ int main(int argc, char *argv[], char *envp) {
 		}
 		file_size = ntohl(file_size_network); /* size of the file */
 
-		/* loop until we either get the whole file or there is an error */
-		total_bytes = zero_bytes = socket_closed = 0;
-		while ( (total_bytes < file_size) &&
-				(! socket_closed)) {
-			bytes_read = sock352_read(connection_fd,buffer,BUFFER_SIZE);
+		/* receive the file straight into the output file, until we get the whole file or there is an error */
+		if (file_size > 0) {
+			if ( (bytes_read = sock352_recvfile(connection_fd,file_fd,file_size)) != file_size) {
+				printf("server: error receiving the file, bytes received %d \n", bytes_read);
+			}
 			if (bytes_read > 0) {
-				total_bytes += bytes_read;
-				bw = write(file_fd,buffer,bytes_read);
-				if (bw != bytes_read) {
-					printf("server: error writing to file at byte %d \n", total_bytes);
-				} else {
-					MD5_Update(&md5_context, buffer, bytes_read);
-				}
-			} else {
-				if (bytes_read == 0) {
-					zero_bytes++;
-				} else {
-					if (bytes_read < 0 ){
-						socket_closed = 1;
-					}
+				total_bytes = bytes_read;
+				/* checksum what was received */
+				if ( (file_map = mmap(NULL,total_bytes,PROT_READ,MAP_SHARED,file_fd,0)) != MAP_FAILED) {
+					MD5_Update(&md5_context, file_map, total_bytes);
+					munmap(file_map,total_bytes);
 				}
 			}
-			if (zero_bytes > MAX_ZERO_BYTE_READS) {
-				printf("server: too many zero byte returns, closing connection\n");
-				socket_closed = 1;
-			}
-		} /* end while socket not closed */
-		printf("zero byte calls is %d \n",zero_bytes);
+		}
 		gettimeofday(&end_time, (struct timezone *) NULL);
 		MD5_Final(md5_out, &md5_context);
 
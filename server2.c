@@ -50,6 +50,7 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <openssl/md5.h>
 
 #include "sock352.h"
@@ -92,11 +93,11 @@ int main(int argc, char *argv[], char *envp[]) {
 		int retval;  /* return code */
 		int listen_fd, connection_fd;
 
-		char buffer[BUFFER_SIZE]; /* read/write buffer */
+		char *file_map; /* the input file mapped for the checksum */
 		char command_string[BUFFER_SIZE]; /* holds the command string to our server */
 		char *token_p, *command_s, *file_name_s, *protocol_s; /* used the parse the command string */
 
-		int end_of_file, total_bytes, bytes_read; /* for reading the input file */
+		int total_bytes, bytes_read; /* for reading the input file */
 
 		/* set defaults */
 		udp_port = SOCK352_DEFAULT_UDP_PORT;
@@ -247,22 +248,20 @@ int main(int argc, char *argv[], char *envp[]) {
 			exit(-1);
 		}
 
-		/* now send the file proper */
-		total_bytes = end_of_file = 0;
-		while ( (total_bytes < file_size) &&   /* the main loop checks both if we've sent the whole file*/
-				(! end_of_file) ) {            /* or there is some other error */
-
-				bytes_read = read(file_fd,buffer,BUFFER_SIZE);  /* read from the file */
-				if (bytes_read > 0) {                      /* check we sent something */
-					total_bytes += bytes_read ;
-					if ( (bw = sock352_write(connection_fd,buffer,bytes_read)) != bytes_read) {
-						printf("server2: error writing byte at count %d bytes written %d \n",total_bytes,bw);
-					} else {
-						MD5_Update(&md5_context, buffer, bytes_read);  /* update the checksum */
-					}
-				} else {
-					end_of_file =1;   /* we got either zero bytes or and error, so finish the loop */
+		/* now send the file proper, the library reads it straight from the page cache */
+		total_bytes = 0;
+		if (file_size > 0) {
+			if ( (bw = sock352_sendfile(connection_fd,file_fd,0,file_size)) != file_size) {
+				printf("server2: error sending the file, bytes written %d \n",bw);
+			}
+			if (bw > 0) {
+				total_bytes = bw;
+				/* checksum what was sent */
+				if ( (file_map = mmap(NULL,total_bytes,PROT_READ,MAP_PRIVATE,file_fd,0)) != MAP_FAILED) {
+					MD5_Update(&md5_context, file_map, total_bytes);  /* update the checksum */
+					munmap(file_map,total_bytes);
 				}
+			}
 		}
 		if ( sock352_close(connection_fd) != SOCK352_SUCCESS) {
 			printf("server2: error with socket close \n");
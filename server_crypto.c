@@ -257,10 +257,31 @@ int decrypt(uint8_t plain[], const uint8_t pk[], const uint8_t sk[],
   return crypto_box_BOXZEROBYTES + length - crypto_box_ZEROBYTES;
 }
 
+/* read exactly size bytes -- one sock352_read may return only part of a message */
+int full_read(int fd, void *buffer, int size) { 
+  int total = 0;
+  int bytes_read;
+
+  while (total < size) {
+    bytes_read = sock352_read(fd,(char *)buffer + total,size - total);
+    if (bytes_read <= 0) { 
+      return (total == 0) ? bytes_read : -1;  /* closed or failed in the middle of a message */
+    }
+    total += bytes_read;
+  }
+  return total;
+
+} /* end full_read */
+
 /* package up a write into an encrypt followed by a write */
+/* each message goes out behind its length (32 bits, network order), the */
+/* connection is a byte stream and doesn't keep write boundaries -- one */
+/* gather write sends both */
 int encrypted_write(int fd, uint8_t *buffer, int size, uint8_t *public_key,
 		    uint8_t *secret_key, uint8_t *nonce)  { 
   int count; 
+  uint32_t length_network;
+  struct iovec iov[2];
   char encrypted_buf[MAX_BUFFER_SIZE];
   
   count = encrypt(encrypted_buf,public_key,secret_key, nonce, buffer, size);
@@ -269,34 +290,52 @@ int encrypted_write(int fd, uint8_t *buffer, int size, uint8_t *public_key,
     return -1; 
   }
 
-  count = sock352_write(fd,encrypted_buf,count);	
+  length_network = htonl(count);
+  iov[0].iov_base = &length_network;
+  iov[0].iov_len = sizeof(length_network);
+  iov[1].iov_base = encrypted_buf;
+  iov[1].iov_len = count;
+  if (sock352_writev(fd,iov,2) != (int) sizeof(length_network) + count) { 
+    return -1;
+  }
   return count; 
 
 } /* end encrypted_write */
 
 /* package up a read into a read followed by a decrypt */
-
-/* package up a read into a read followed by a decrypt */
+/* reads one whole message, length first (see encrypted_write) */
 int decrypted_read(int fd, uint8_t *buffer, int size,
 		   int8_t *public_key, uint8_t *secret_key,uint8_t *nonce) { 
   int bytes_read; 
   int count;
+  uint32_t length, length_network;
   char tmp_buffer[2*MAX_BUFFER_SIZE];  /* deal with zero-byte pads here */
   char tmp_buffer_plain[2*MAX_BUFFER_SIZE];
 
-  /* the first string is the command and the name of the file as an ASCII string */
-  bytes_read = sock352_read(fd,tmp_buffer,MAX_BUFFER_SIZE);
+  /* the length of the message, then the message */
+  bytes_read = full_read(fd,&length_network,sizeof(length_network));
   if (bytes_read <= 0) { 
     return bytes_read; 
   }
+  length = ntohl(length_network);
+  if ( (length == 0) || (length > MAX_BUFFER_SIZE) ) { 
+    printf("bad message length %u in read \n", length);
+    return -1;
+  }
+  bytes_read = full_read(fd,tmp_buffer,length);
+  if (bytes_read != (int) length) { 
+    printf("message cut short in read \n");
+    return -1; 
+  }
   
   /* decrypt the message  */ 
   memset(buffer,0,size);
   memset(tmp_buffer_plain,0,2*MAX_BUFFER_SIZE);
   count = decrypt(tmp_buffer_plain, public_key, secret_key, nonce, 
 			     tmp_buffer, bytes_read);  
-  if (count <= 0 ) { 
+  if (count < 0 ) { 
     printf("decryption in read failed \n");
+    return -1;
   }
 
   if (count <= size) {
@@ -500,11 +539,11 @@ int main(int argc, char *argv[], char **envp) {
 		  printf("server_crypto: write of nonce failed \n");
 		}
 		
-		count = decrypted_read(connection_fd,command_string_decrypt, BUFFER_SIZE,
+		count = decrypted_read(connection_fd,command_string_decrypt, BUFFER_SIZE-1,
 				       remote_public_key, my_secret_key, nonce);
 				     
 
-		command_string_decrypt[BUFFER_SIZE] = '\0'; /* make sure the string is null-terminated */
+		command_string_decrypt[BUFFER_SIZE-1] = '\0'; /* make sure the string is null-terminated */
 
 		/* use strtok to parse the command and name of the file */
 		token_p = strtok(command_string_decrypt," ");
@@ -44,6 +44,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 /* Structure describing a CS 352 socket address.  */
 struct sockaddr_sock352 {
@@ -59,17 +60,78 @@ struct sockaddr_sock352 {
 };
 typedef struct sockaddr_sock352 sockaddr_sock352_t;  /* add type shortcut */
 
+/* Per-connection statistics, filled in by sock352_getstats() */
+struct sock352_stats {
+	uint64_t srtt_usec;      /* smoothed round trip time */
+	uint64_t rttvar_usec;    /* round trip time variance */
+	uint64_t rto_usec;       /* current retransmission timeout */
+	uint64_t packets_sent;   /* packets handed to the network, including retransmissions */
+	uint64_t retransmits;    /* packets retransmitted */
+	uint64_t timeouts;       /* retransmission timer expirations */
+	uint64_t loss_events;    /* windows in which losses were detected (congestion signals) */
+	uint64_t cwnd;           /* congestion window, in packets */
+	uint64_t ssthresh;       /* slow start threshold, in packets */
+	uint64_t pacing_rate;    /* current pacing rate in bytes/sec, 0 when not pacing */
+	uint64_t pacing_waits;   /* times a send was held back by the pacing timer */
+	uint64_t send_batches;   /* sendmmsg calls */
+	uint64_t send_batch_packets; /* datagrams sent by them (average batch = packets / batches) */
+	uint64_t recv_batches;   /* recvmmsg calls that returned datagrams */
+	uint64_t recv_batch_packets; /* datagrams received by them */
+	uint64_t gso_sends;      /* UDP GSO super-buffers sent */
+	uint64_t gso_packets;    /* datagrams carried by them */
+	uint64_t gro_receives;   /* UDP GRO buffers received */
+	uint64_t gro_packets;    /* datagrams split out of them */
+	uint64_t handshakes;     /* listener -- connections established in the background */
+	uint64_t syn_drops;      /* listener -- SYNs dropped because the backlog was full */
+	uint64_t syn_timeouts;   /* listener -- handshakes that never completed */
+	uint64_t syn_cookies;    /* listener -- SYN|ACKs sent with a cookie instead of a half-open connection */
+	uint64_t bad_cookies;    /* listener -- ACKs from unknown clients that carried no valid cookie */
+	uint64_t fast_opens;     /* listener -- connections queued for accept on the data in their SYN */
+	uint64_t bad_fast_opens; /* listener -- SYNs whose data was dropped for lack of a valid fast open cookie */
+	uint64_t acks_sent;      /* ACKs sent (acks_sent / data_received is the ACK-to-data ratio) */
+	uint64_t data_received;  /* data (and FIN) packets received, duplicates included */
+	uint64_t mss;            /* payload bytes per packet in use */
+	uint64_t mtu_probes;     /* path MTU probes sent */
+	uint64_t bad_packets;    /* datagrams dropped because they were damaged or their length didn't match their header */
+	uint64_t pool_hits;      /* packet buffers reused from the packet pool */
+	uint64_t pool_misses;    /* packet buffers that had to come from the heap */
+};
+typedef struct sock352_stats sock352_stats_t;
+
+/* Readiness of a sock352 fd, for sock352_epoll_ctl() and sock352_epoll_wait() */
+struct sock352_epoll_event {
+	uint32_t events;         /* SOCK352_EPOLL* */
+	int fd;                  /* the sock352 fd */
+};
+typedef struct sock352_epoll_event sock352_epoll_event_t;
+
 extern int sock352_init(int udp_port);
 extern int sock352_init2(int remote_port, int local_port);
 extern int sock352_init3(int remote_port, int local_port, char *envp[] );
 extern int sock352_socket(int domain, int type, int protocol);
 extern int sock352_bind(int fd, sockaddr_sock352_t *addr, socklen_t len);
 extern int sock352_connect(int fd, sockaddr_sock352_t *addr, socklen_t len);
+extern int sock352_connect_with_data(int fd, sockaddr_sock352_t *addr, socklen_t len, void *buf, int count);
 extern int sock352_listen(int fd, int n);
 extern int sock352_accept(int _fd, sockaddr_sock352_t *addr, int *len);
 extern int sock352_close(int fd);
+/* connections are byte streams, like TCP: a read returns up to count bytes
+ * taken from one or more writes, and the bytes of one write may take several
+ * reads -- apps that exchange messages have to frame them (see
+ * encrypted_write/decrypted_read in client_crypto.c) */
 extern int sock352_read(int fd, void *buf, int count);
 extern int sock352_write(int fd, void *buf, int count);
+extern int sock352_readv(int fd, const struct iovec *iov, int iovcnt);
+extern int sock352_writev(int fd, const struct iovec *iov, int iovcnt);
+extern ssize_t sock352_sendfile(int fd, int file_fd, off_t offset, size_t count);
+extern ssize_t sock352_recvfile(int fd, int out_fd, size_t size);
+extern int sock352_setsockopt(int fd, int option, int value);
+extern int sock352_getsockopt(int fd, int option, int *value);
+extern int sock352_getstats(int fd, struct sock352_stats *stats);
+extern int sock352_flush(int fd);
+extern int sock352_epoll_create(int size);
+extern int sock352_epoll_ctl(int epfd, int op, int fd, struct sock352_epoll_event *event);
+extern int sock352_epoll_wait(int epfd, struct sock352_epoll_event *events, int maxevents, int timeout);
 
 /* the protocol and address families for CS 352 sockets */
 #define PF_CS352 (0x1F)
@@ -87,10 +149,40 @@ extern int sock352_write(int fd, void *buf, int count);
 #define SOCK352_FIN  (0x02)
 #define SOCK352_ACK  (0x04)
 #define SOCK352_RESET (0x08)
+#define SOCK352_PROBE (0x10) /* path MTU probe (padding only), answered with SOCK352_PROBE | SOCK352_ACK */
 #define SOCK352_HAS_OPT (0xA0)
 
 #define SOCK352_DEFAULT_UDP_PORT (27182)  /* first digits of the number e */
 
+/* per-socket options for sock352_setsockopt/sock352_getsockopt */
+#define SOCK352_OPT_WINDOW (1)  /* max packets in flight (also SOCK352_WINDOW env) */
+#define SOCK352_OPT_LOSS   (2)  /* percent of sent packets to drop, for testing (also SOCK352_LOSS env) */
+#define SOCK352_OPT_SACK   (3)  /* 1 to send selective acknowledgements (default), 0 to turn off (also SOCK352_SACK env) */
+#define SOCK352_OPT_CC     (4)  /* congestion control algorithm, SOCK352_CC_* (also SOCK352_CC=newreno|cubic env) */
+#define SOCK352_OPT_PACING (5)  /* 1 to pace packets over the round trip time (default), 0 to send in bursts (also SOCK352_PACING env) */
+#define SOCK352_OPT_GSO    (6)  /* 1 to hand batches to the kernel as UDP GSO super-buffers, 0 to send datagram by datagram (default) (also SOCK352_GSO env) */
+#define SOCK352_OPT_GRO    (7)  /* 1 to let the kernel coalesce received datagrams with UDP GRO, 0 to receive datagram by datagram (default) (also SOCK352_GRO env) */
+#define SOCK352_OPT_SYNCOOKIES (8)  /* listener -- 0 never answer with SYN cookies (default), 1 once the backlog is full, 2 always (also SOCK352_SYNCOOKIES env) */
+#define SOCK352_OPT_ACK_EVERY (9)  /* ACK at least every n in-order data packets (default 2) (also SOCK352_ACK_EVERY env) */
+#define SOCK352_OPT_ACK_DELAY (10) /* usec an ACK for fewer packets may wait, 0 to ACK every receive batch (default 2000) (also SOCK352_ACK_DELAY env) */
+#define SOCK352_OPT_MSS (11) /* payload bytes per packet, 0 to find the largest the path carries by probing (default) (also SOCK352_MSS env) */
+#define SOCK352_OPT_NODELAY (12) /* 1 to send small writes right away, 0 to hold a partial packet while data is in flight (Nagle, default) (also SOCK352_NODELAY env) */
+#define SOCK352_OPT_CORK (13) /* 1 to hold partial packets until uncorked, flushed, full or 200 ms old, 0 to stop (default) */
+
+/* readiness events for sock352_epoll_ctl/sock352_epoll_wait (level triggered) */
+#define SOCK352_EPOLLIN  (0x001)  /* data (or end of stream) to read, or a connection to accept */
+#define SOCK352_EPOLLOUT (0x004)  /* room in the send buffer */
+#define SOCK352_EPOLLERR (0x008)  /* the connection failed (always reported) */
+
+/* operations for sock352_epoll_ctl */
+#define SOCK352_EPOLL_CTL_ADD (1)
+#define SOCK352_EPOLL_CTL_DEL (2)
+#define SOCK352_EPOLL_CTL_MOD (3)
+
+/* congestion control algorithms for SOCK352_OPT_CC */
+#define SOCK352_CC_NEWRENO (1)
+#define SOCK352_CC_CUBIC   (2)  /* default */
+
 /* a CS 352 RDP protocol packet header */
 struct __attribute__ ((__packed__)) sock352_pkt_hdr {
 	uint8_t version;        /* version number */
@@ -108,4 +200,24 @@ struct __attribute__ ((__packed__)) sock352_pkt_hdr {
 };
 typedef struct sock352_pkt_hdr sock352_pkt_hdr_t;
 
+/* header options -- when SOCK352_HAS_OPT is set in the flags, opt_ptr
+ * holds the option type and the option bytes sit between the header and
+ * the payload (header_len covers both)
+ * */
+
+#define SOCK352_OPT_TYPE_SACK (0x01)
+#define SOCK352_MAX_SACK_BLOCKS (8)
+
+/* a listener's SYN|ACK carries the client's fast open cookie (a uint64_t);
+ * the client puts it in the ack_no of later SYNs that carry data, and the
+ * listener only takes data from a SYN with a valid cookie */
+#define SOCK352_OPT_TYPE_FASTOPEN (0x02)
+
+/* a SACK block -- sequence numbers [start, end) were received out of order */
+struct __attribute__ ((__packed__)) sock352_sack_block {
+	uint64_t start;         /* first sequence number in the block */
+	uint64_t end;           /* one past the last sequence number in the block */
+};
+typedef struct sock352_sack_block sock352_sack_block_t;
+
 #endif /* sock352.h */
\ No newline at end of file
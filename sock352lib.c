@@ -14,10 +14,28 @@ Megan Murray (msm230)
 
  */
 
+#define _GNU_SOURCE /* ppoll */
 #include "sock352.h"
 #include "socket352.c"
+#include "engine352.c"
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern char **environ;
+
+/* 
+ * What sock352_epoll_ctl keeps in an epoll_event: the sock352 fd (low 32 
+ * bits), the SOCK352_EPOLL* asked for (8 bits) and the generation of the 
+ * socket's eventfd (high 24 bits)
+ */
+#define READY_GEN_MASK 0xffffff
+#define READY_DATA(fd, events, gen) (((uint64_t)((gen) & READY_GEN_MASK) << 40) | ((uint64_t)((events) & 0xff) << 32) | (uint32_t)(fd))
+#define READY_FD(data) ((int)(uint32_t)(data))
+#define READY_EVENTS(data) ((uint32_t)((data) >> 32) & 0xff)
+#define READY_GEN(data) ((uint32_t)((data) >> 40))
 
  /* 
   * All the current (active) connections
@@ -50,6 +68,7 @@ int sock352_init(int udp_port)
 	 */
 	temp = (socket352_t *)calloc(1, sizeof(socket352_t)); 
 	initSocket(temp); 
+	loadEnvOptions(temp, environ); 
 
 	/* 
 	 * Set the port values 
@@ -86,6 +105,7 @@ int sock352_init2(int remote_port, int local_port)
      */
     temp = (socket352_t *)calloc(1, sizeof(socket352_t)); 
     initSocket(temp);
+    loadEnvOptions(temp, environ); 
 
     /* 
      * Set the remote port 
@@ -117,10 +137,10 @@ int sock352_init3(int remote_port, int local_port, char *env_p[]){
 	}
 
 	/* 
-	 *  Set the environment variables ????
-	 *  what do we do with the env_p ????
+	 *  Set the socket options from the environment variables 
+	 *  (e.g. SOCK352_WINDOW=32)
 	 */
-
+	loadEnvOptions(temp, env_p); 
 
 	return SOCK352_SUCCESS; 
 }
@@ -162,12 +182,26 @@ int sock352_socket(int domain, int type, int protocol)
 		printf("Failed to create socket in sock352_socket(): %s\n", strerror(errno)); 
 		return SOCK352_FAILURE; 
 	} 
-	temp->sock_fd = sock_fd; 
+
+	/* 
+	 *  The new socket gets the ports and options from init
+	 */
+	socket352_t *socket = newSocket(temp); 
+	socket->sock_fd = sock_fd; 
+
+	/* 
+	 *  Make room in the kernel for a full window of packets (best effort)
+	 */
+	int buffer_size = SOCK352_SOCKET_BUFFER; 
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)); 
+	setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)); 
 
 	/* 
 	 * Add the socket to the socket list 
 	 */
-	int sfd = addSocket(&sockets, temp);
+	int sfd = addSocket(&sockets, socket);
+
+	return sfd; 
 }
 
 /*
@@ -213,6 +247,26 @@ int sock352_bind(int fd, sockaddr_sock352_t *addr, socklen_t len)
  *  called only from client 
  */ 
 int sock352_connect(int fd, sockaddr_sock352_t *dest, socklen_t len)
+{
+	return sock352_connect_with_data(fd, dest, len, NULL, 0); 
+}
+
+/*
+ *  sock352_connect_with_data
+ *
+ *  connects and sends count bytes of buf: the first packet of them rides 
+ *  in the SYN, so the server has the request a round trip earlier, the 
+ *  rest is written once connected 
+ *  called only from client 
+ *
+ *  --> only a SYN with the fast open cookie the server gave us on an 
+ *      earlier connection carries data; without one (or if the server 
+ *      didn't take it -- SYN cookies, a new key) the packet is queued 
+ *      again like a write, at the sequence number after the SYN
+ *  --> the SYN is sent again on the RTO, doubling each time; connect fails 
+ *      after SOCK352_SYN_RETRIES unanswered resends (about a minute)
+ */ 
+int sock352_connect_with_data(int fd, sockaddr_sock352_t *dest, socklen_t len, void *buf, int count)
 {
 	/* 
 	 * Get our socket from the hash table 
@@ -223,6 +277,11 @@ int sock352_connect(int fd, sockaddr_sock352_t *dest, socklen_t len)
 		return SOCK352_FAILURE; 
 	}
 
+	if(count < 0 || (count > 0 && buf == NULL)){
+		printf("Invalid data in sock352_connect_with_data()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
 	/* 
 	 * Create the destination sockaddr_in 
 	 */
@@ -235,54 +294,118 @@ int sock352_connect(int fd, sockaddr_sock352_t *dest, socklen_t len)
 	 * Create the packet to send 
 	 */
 	packet_t packet; 
+	memset(&packet.header, 0, sizeof(sock352_pkt_hdr_t)); 
 	packet.header.version = SOCK352_VER_1; 
-	packet.header.header_len = htons((uint16_t)sizeof(sock352_pkt_hdr_t));
+	packet.header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t);
 	packet.header.flags = SOCK352_SYN; 
 	packet.header.sequence_no = getSeqNumber(socket);
 	packet.header.window = sizeof(packet.data);
 
-	printf("header len: %d\n", packet.header.header_len);
-
 	/* 
-	 * Send the packet to the destination
+	 * The first packet of data takes the next sequence number, and rides 
+	 * in the SYN with the server's cookie in ack_no if we have one 
 	 */
-	if((sendto(socket->sock_fd, &(packet.header), sizeof(sock352_pkt_hdr_t), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in))) < 0){
-		printf("Failed to send SYN packet in sock352_connect(): %s\n", strerror(errno));
-		return SOCK352_FAILURE; 
+	uint64_t data_seq = 0; 
+	int first = (count < socket->mss) ? count : socket->mss; 
+	int syn_count = 0; 
+	if(first > 0){
+		data_seq = getSeqNumber(socket); 
+		uint64_t cookie = findFastOpenCookie(socket->other); 
+		if(cookie != 0){
+			memcpy(packet.data, buf, first); 
+			packet.header.payload_len = htons(first); 
+			packet.header.ack_no = cookie; 
+			syn_count = first; 
+		}
 	}
 
+	setChecksum(&packet.header, sizeof(sock352_pkt_hdr_t) + syn_count); 
+
 	/* 
 	 * Change the connection state 
 	 */
 	socket->state = SYN_SENT; 
 
 	/* 
-	 * Wait for packet to arrive from server 
+	 * Send the SYN and wait for the SYN|ACK from the server, sending the 
+	 * SYN again each time the (backed off) RTO runs out -- skip anything 
+	 * else the server sends (in answer to our data, it is sent again), and 
+	 * anything damaged or whose length doesn't match its header 
 	 */
+	packet_t reply; 
+	uint64_t syn_time = 0, deadline = 0; 
 	socklen_t sockaddr_size = sizeof(struct sockaddr_in); 
-	printf("Waiting for packet from server...\n");
-	if((recvfrom(socket->sock_fd, &(packet.header), sizeof(packet_t), 0, (struct sockaddr *)socket->other, &sockaddr_size)) < 0){
-		printf("Failed to read packet from server in sock352_connect(): %s\n", strerror(errno)); 
-		return SOCK352_FAILURE; 
+	while(1){
+		uint64_t now = nowUsec(); 
+		if(now >= deadline){
+			if(syn_time != 0 && ++socket->backoffs > SOCK352_SYN_RETRIES){
+				printf("Connection timed out in sock352_connect()\n"); 
+				socket->state = CLOSED; 
+				return SOCK352_FAILURE; 
+			}
+			if((sendto(socket->sock_fd, &(packet.header), sizeof(sock352_pkt_hdr_t) + syn_count, 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in))) < 0){
+				printf("Failed to send SYN packet in sock352_connect(): %s\n", strerror(errno));
+				return SOCK352_FAILURE; 
+			}
+			syn_time = now; 
+			deadline = now + currentRto(socket); 
+		}
+
+		struct pollfd pfd = { socket->sock_fd, POLLIN, 0 }; 
+		int ready = poll(&pfd, 1, (int)((deadline - now + 999) / 1000)); 
+		if(ready < 0 && errno != EINTR){
+			printf("Failed to wait for the server in sock352_connect(): %s\n", strerror(errno)); 
+			return SOCK352_FAILURE; 
+		}
+		if(ready <= 0) continue; 
+
+		ssize_t len = recvfrom(socket->sock_fd, &(reply.header), MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)socket->other, &sockaddr_size); 
+		if(len < 0){
+			printf("Failed to read packet from server in sock352_connect(): %s\n", strerror(errno)); 
+			return SOCK352_FAILURE; 
+		}
+		if(!checkPacket(&reply, len)) continue; 
+		if((reply.header.flags & (SOCK352_SYN | SOCK352_ACK)) == (SOCK352_SYN | SOCK352_ACK)) break; 
 	}
+	saveFastOpenCookie(socket->other, &reply); 
 
 	/* 
-	 * Got packet from the server.. make sure SYN|ACK is set
-	
-	if(packet->header.flags != (SOCK352_SYN | SOCK352_ACK)){
-		printf("Invalid packet received from server\n"); 
-		return SOCK352_FAILURE; 
-	}
-	*/
+	 * The handshake gives us the first round trip time sample, unless the 
+	 * SYN went out more than once (Karn) 
+	 */
+	if(socket->backoffs == 0) updateRtt(socket, nowUsec() - syn_time); 
+	socket->backoffs = 0; 
 
-	printf("packet->header_len: %d\n", packet.header.header_len);
+	/* 
+	 * The server ACKs the data with the SYN (ack_no past it), otherwise 
+	 * it goes out again as the first packet 
+	 */
+	uint64_t server_next = reply.header.ack_no; 
+	if(first > 0 && server_next <= data_seq){
+		packet_t *data = allocPacket(socket); 
+		if(data == NULL) return SOCK352_FAILURE; 
+		memcpy(data->data, buf, first); 
+		data->size = first; 
+		data->header.version = SOCK352_VER_1; 
+		data->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
+		data->header.payload_len = htons(first); 
+		data->header.sequence_no = data_seq; 
+		addSendPacket(socket, data); 
+	}
 
 	/* 
-	 * Update packet header to be sent 
+	 * Update packet header to be sent -- the ACK doesn't use up a sequence number 
 	 */
 	packet.header.flags = SOCK352_ACK; 
-	packet.header.ack_no = packet.header.sequence_no + 1; 
-	packet.header.sequence_no = getSeqNumber(socket);
+	packet.header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
+	packet.header.ack_no = reply.header.sequence_no + 1; 
+	packet.header.sequence_no = server_next;
+	packet.header.payload_len = 0; 
+
+	/* 
+	 *  The server's data starts right after its SYN 
+	 */
+	socket->recv_next = packet.header.ack_no; 
 
 	/* 
 	 *  Set connection as established
@@ -292,21 +415,29 @@ int sock352_connect(int fd, sockaddr_sock352_t *dest, socklen_t len)
 	/* 
 	 *  Set the updated ACK packet to the server
 	 */ 
+	setChecksum(&packet.header, sizeof(sock352_pkt_hdr_t)); 
 	if((sendto(socket->sock_fd, &(packet.header), sizeof(sock352_pkt_hdr_t), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in))) < 0){
 		printf("Failed to send ACK packet in sock352_connect(): %s\n", strerror(errno)); 
 		return SOCK352_FAILURE;
 	}
 
 	/* 
-	 *  Create the transmit and receive lists 
-	 
-	socket->unack_packets = (packet_t *)calloc(1, sizeof(packet_t)); 
-	socket->recv_packets = (packet_t *)calloc(1, sizeof(packet_t));
-	*/
+	 *  The engine thread runs the connection from here on (and probes 
+	 *  the path for a larger MSS)
+	 */
+	startProbing(socket); 
+	if(engineAdd(socket) < 0){
+		printf("Failed to start the connection in sock352_connect()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
 	/* 
-	 *  Free stuff ( the packet )
+	 *  Whatever didn't fit in the first packet is a plain write 
 	 */
-	//free(packet);
+	if(count > first && sock352_write(fd, (char *)buf + first, count - first) != count - first){
+		printf("Failed to write the data in sock352_connect_with_data()\n"); 
+		return SOCK352_FAILURE; 
+	}
 
 	return SOCK352_SUCCESS;
 }
@@ -330,15 +461,25 @@ int sock352_listen(int fd, int n)
 	 }
 
 	/* 
-	 * Allocate space for the connections 
+	 * Up to n connections handshaking or waiting for sock352_accept 
 	 */
-	socket->n_connections = n; 
-	socket->connections = (int *)calloc(n, sizeof(int)); 
+	socket->n_connections = (n > 0) ? n : 1; 
+	initCookies(socket); 
 
 	/* 
 	 *  Change the socket to LISTEN state
 	 */
 	socket->state = LISTEN;
+	socket->is_listener = 1; 
+
+	/* 
+	 *  The engine receives on the UDP socket from here on and routes the 
+	 *  packets of accepted connections
+	 */
+	if(engineAdd(socket) < 0){
+		printf("Failed to start listening in sock352_listen()\n"); 
+		return SOCK352_FAILURE; 
+	}
 
 	return SOCK352_SUCCESS;
 }
@@ -350,6 +491,11 @@ int sock352_listen(int fd, int n)
  *  return value is a new fd, the connected fd.
  *  addr is the address of the client that just connected
  *  called only by server side
+ *
+ *  --> the connection shares the listening UDP socket, the engine routes 
+ *      its packets by the client's address and port
+ *  --> the engine completes handshakes in the background, accept only 
+ *      takes the oldest established connection off the accept queue
  */
 int sock352_accept(int _fd, sockaddr_sock352_t *addr, int *len)
 {
@@ -362,106 +508,68 @@ int sock352_accept(int _fd, sockaddr_sock352_t *addr, int *len)
 		return SOCK352_FAILURE; 
 	}
 
-	/* 
-	 *  Initalize the other sockaddr
-	 */
-	socket352->other = (struct sockaddr_in *)calloc(1, sizeof(struct sockaddr_in)); 
-
-	/* 
-	 *  Create a packet struct to hold the incoming packet
-	 */
-	packet_t *packet = (packet_t *)calloc(1, sizeof(packet_t)); 
-
-	/* 
-	 *  Create a socklen_t to size
-	 */
-	socklen_t sockaddr_size = sizeof(struct sockaddr_in); 
-
-	/* 
-	 * Wait for an incoming SYN packet header
-	 */ 
-	printf("Waiting for client SYN packet...\n");
-	if((recvfrom(socket352->sock_fd, &(packet->header), sizeof(sock352_pkt_hdr_t), 0, (struct sockaddr *)socket352->other, &sockaddr_size)) < 0){
-		printf("Failed to read from socket in sock352_accept(): %s\n", strerror(errno)); 
+	if(socket352->state != LISTEN){
+		printf("Socket is not listening in sock352_accept()\n"); 
 		return SOCK352_FAILURE; 
 	}
 
-	printf("packet->header.header_len: %u\n", packet->header.header_len);
-
-	/* 
-	 * Got first packet from client.. Check if SYN bit is set 
-	 */
-	if(packet->header.flags != SOCK352_SYN){
-		printf("Invalid packet received in sock352_accept()\n"); 
-		return SOCK352_FAILURE; 
-	}
-
-	/* 
-	 * Change the socket state 
-	 */
-	socket352->state = SYN_RECEIVED; 
-
 	/* 
-	 *  Update packet to be sent 
+	 * Wait for the engine to finish a handshake -- it answers SYNs and 
+	 * queues the connections once the client's ACK arrives
 	 */ 
-	packet->header.flags = SOCK352_SYN | SOCK352_ACK; 
-	packet->header.ack_no = packet->header.sequence_no;
-	packet->header.sequence_no = getSeqNumber(socket352); 
-	packet->header.window = sizeof(packet->data);
-
+	lockSocket(socket352); 
+	while(socket352->accept_queue == NULL){
+		if(socket352->error || socket352->state != LISTEN){
+			unlockSocket(socket352); 
+			printf("Failed to read from socket in sock352_accept()\n"); 
+			return SOCK352_FAILURE; 
+		}
+		waitSocket(socket352); 
+	}
+	socket352_t *client = socket352->accept_queue; 
+	unqueueSocket(&socket352->accept_queue, &socket352->accept_tail, client); 
+	socket352->n_accept--; 
+	unlockSocket(socket352); 
 
 	/* 
-	 *  Send the updated packet 
+	 *  The app gets an fd for the connection, the engine runs its timers 
 	 */
-	if((sendto(socket352->sock_fd, &(packet->header), sizeof(sock352_pkt_hdr_t), 0, (struct sockaddr *)socket352->other, sockaddr_size)) < 0){
-		printf("Failed to send SYN|ACK packet in sock352_accept(): %s\n", strerror(errno));
+	int fd = addSocket(&sockets, client); 
+	lockSocket(client); 
+	startProbing(client); 
+	unlockSocket(client); 
+	if(engineAdd(client) < 0){
+		printf("Failed to start the connection in sock352_accept()\n"); 
 		return SOCK352_FAILURE; 
 	}
 
 	/* 
-	 * Change the state to established
-	 */ 
-	socket352->state = ESTABLISHED; 
-
-	/* 
-	 *  Get ACK packet 
+	 *  Tell the app who connected
 	 */
-	printf("Waiting for ACK packet from client\n");
-	if((recvfrom(socket352->sock_fd, packet, sizeof(packet_t), 0, (struct sockaddr *) socket352->other, &sockaddr_size)) < 0){
-		printf("Failed to received ACK packet in sock352_accept(): %s\n", strerror(errno));
-		return SOCK352_FAILURE;
+	if(addr != NULL){
+		memset(addr, 0, sizeof(sockaddr_sock352_t)); 
+		addr->sin_family = AF_CS352; 
+		addr->sin_addr = client->other->sin_addr; 
+		addr->sin_port = client->other->sin_port; 
+		addr->cs352_port = client->demux_key.cs352_port; 
 	}
+	if(len != NULL) *len = sizeof(sockaddr_sock352_t); 
 
-	/*
-	if(packet->header.flags != SOCK352_ACK){
-		printf("Invalid ACK packet in sock352_accept()\n");
-		return SOCK352_FAILURE;
-	}*/
-
-	/* 
-	 *  Create the connection for the client structure 
-	 */ 
-	socket352_t *client = (socket352_t *)calloc(1, sizeof(socket352_t));
-	client->other = (struct sockaddr_in *)calloc(1, sizeof(struct sockaddr_in));
-	//addSocket(&sockets, client);
-	addClient(socket352, client);
-
-	/* 
-	 *  Free stuff
-	 */
-	free(packet); 
-
-	return socket352->fd; 
+	return fd; 
 }
 /*  sock352_close
  *
  *  Closes the specified socket connection
  *  releases any memory and general cleanup may be needed
  *  called by both client and server
+ *
+ *  --> the FIN is queued behind any buffered data 
+ *  --> wait until everything we sent is ACKed and the other's FIN arrived
+ *  --> closing a listener doesn't touch the connections it accepted, 
+ *      their shared UDP socket is closed along with the last of them
  */
 int sock352_close(int fd)
 {
-	printf("closing... \n");
 	/* 
 	 *  Get the socket 
 	 */
@@ -470,79 +578,125 @@ int sock352_close(int fd)
 		printf("Unable to find socket in sock352_close()\n");
 		return SOCK352_FAILURE; 
 	}
+
+	/* 
+	 *  A listener stops taking new clients. Its accepted connections share 
+	 *  its UDP socket -- the engine keeps routing their packets and the 
+	 *  last of them to close closes the UDP socket 
+	 */
+	if(socket->state == LISTEN){
+		lockSocket(socket); 
+		if(socket->ready_fd >= 0) close(socket->ready_fd); 
+		socket->ready_fd = -1; 
+		socket->ready_gen++; 
+		socket->state = CLOSED; 
+
+		/* 
+		 *  Connections the app never accepted go with it 
+		 */
+		socket352_t *client; 
+		while((client = socket->pending) != NULL){
+			removePending(socket, client); 
+			if(client->fast_open) continue; /* in the accept queue, or the app's */
+			HASH_DELETE(demux_hh, socket->demux, client); 
+			freeSocket(client); 
+		}
+		while((client = socket->accept_queue) != NULL){
+			unqueueSocket(&socket->accept_queue, &socket->accept_tail, client); 
+			HASH_DELETE(demux_hh, socket->demux, client); 
+			freeBatch(client); 
+			freeSocket(client); 
+		}
+		socket->n_pending = socket->n_accept = 0; 
+		int last = (socket->demux == NULL); 
+		signalSocket(socket); /* a blocked sock352_accept fails */
+		unlockSocket(socket); 
+
+		if(last){
+			engineRemove(socket); 
+			close(socket->sock_fd); 
+			freeBatch(socket); 
+			if(engineIdle()) trimPool(); 
+		}
+		return SOCK352_SUCCESS; 
+	}
+
+	/* 
+	 *  A connection accepted on the data in its SYN may still wait for 
+	 *  the client's ACK
+	 */
+	if(socket->state != ESTABLISHED && socket->state != SYN_RECEIVED){
+		printf("Socket is not connected in sock352_close()\n");
+		return SOCK352_FAILURE; 
+	}
 	
 	/* 
-	 *  Create the fin packet
+	 *  Create the fin packet -- it takes a sequence number so it is ACKed like data
 	 */
-	packet_t *fin_packet = (packet_t *)calloc(1, sizeof(packet_t)); 
+	packet_t *fin_packet = allocPacket(socket); 
+	if(fin_packet == NULL) return SOCK352_FAILURE; 
 	fin_packet->header.version = SOCK352_VER_1;
 	fin_packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
 	fin_packet->header.payload_len = 0; 
 	fin_packet->header.flags = SOCK352_FIN; 
 
-	if(sendto(socket->sock_fd, fin_packet, sizeof(packet_t), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in)) < 0){
-		printf("Failed to send packet in sock352_close(): %s\n", strerror(errno)); 
-		return SOCK352_FAILURE; 
-	}
-
+	lockSocket(socket); 
+	fin_packet->header.sequence_no = getSeqNumber(socket); 
+	addSendPacket(socket, fin_packet); 
 	socket->state = FIN_WAIT_1; 
+	wakeSocket(socket); 
 
 	/*
-	 *  Get a packet from the other side
+	 *  Wait until our FIN is ACKed and we got theirs. If the other side 
+	 *  already closed, only retry our FIN a few times -- it may be gone already.
 	 */
-	packet_t  *r_packet = (packet_t *)calloc(1, sizeof(packet_t));
-
-	if(recvfrom(socket->sock_fd, r_packet, sizeof(packet_t), 0, NULL, NULL) < 0){
-		printf("Failed to receive fin packet in sock352_close(): %s\n", strerror(errno)); 
-		return SOCK352_FAILURE; 
-	} 
+	while((socket->send_queue != NULL || socket->unack_packets != NULL || !socket->peer_fin) && !socket->error){
+		if(socket->peer_fin && socket->backoffs >= SOCK352_FIN_RETRIES) break; 
+		waitSocket(socket); 
+	}
 
-	socket->state = LAST_ACK; 
+	int rc = socket->error ? SOCK352_FAILURE : SOCK352_SUCCESS; 
+	if(socket->error) printf("Connection failed in sock352_close()\n"); 
+	socket->state = CLOSED; 
+	unlockSocket(socket); 
 
 	/* 
-	 * Create the ack packet 
+	 *  Take the connection away from the engine (and its listener) and 
+	 *  close the socket
 	 */
-	packet_t *ack_packet = (packet_t *)calloc(1, sizeof(packet_t)); 
-	ack_packet->header.version = SOCK352_VER_1; 
-	ack_packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
-	ack_packet->header.payload_len = 0; 
-	ack_packet->header.flags = SOCK352_ACK; 
+	int last = (socket->listener != NULL) ? removeDemux(socket) : 0; 
+	engineRemove(socket); 
+	if(socket->listener == NULL) close(socket->sock_fd);
+	lockSocket(socket); 
+	if(socket->ready_fd >= 0) close(socket->ready_fd); 
+	socket->ready_fd = -1; 
+	socket->ready_gen++; 
+	unlockSocket(socket); 
+	freeBatch(socket); 
 
 	/* 
-	 *  Send the ack packet
-	 */
-	if(sendto(socket->sock_fd, ack_packet, sizeof(packet_t), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in)) < 0){
-		printf("Failed to send ack packet in sock352_close(): %s\n", strerror(errno)); 
-		return SOCK352_FAILURE; 
-	}
-
-	/*
-	 * Get ACK packet from the other side 
+	 *  The last connection of a closed listener closes their UDP socket 
 	 */
-	if(recvfrom(socket->sock_fd, r_packet, sizeof(packet_t), 0, NULL, NULL) < 0){
-		printf("Failed to receive ack packet in sock352_close(): %s\n", strerror(errno)); 
-		return SOCK352_FAILURE; 
+	if(last){
+		engineRemove(socket->listener); 
+		close(socket->listener->sock_fd); 
+		freeBatch(socket->listener); 
 	}
 
-	socket->state = CLOSED; 
-
 	/* 
-	 *  Close socket
+	 *  Free things -- anything the app never read or never got ACKed
 	 */
-	close(socket->sock_fd);
-
-	printf("closed socket\n");
+	packet_t *packet; 
+	freeRecvRing(socket); 
+	while((packet = popSendPacket(socket)) != NULL) freePacket(packet); 
+	while(socket->unack_packets != NULL) removeTransPacket(socket, socket->unack_packets); 
 
 	/* 
-	 *  Free things
+	 *  The last connection gives the packet pool back to the heap 
 	 */
-	//free(fin_packet);
-	//free(r_packet);
-	//free(ack_packet);
-	//free(socket);
-	//free(sockets);
+	if(engineIdle()) trimPool(); 
 
-	return SOCK352_SUCCESS;
+	return rc;
 
 }
 
@@ -557,72 +711,131 @@ int sock352_close(int fd)
  *  @param: fd 		-	the fd to read from
  * 	@param: buf 	- 	the buf to read to
  *  @param: count 	- 	the max number of bytes to read in 
- *  @return: the number of bytes we read from the fd
+ *  @return: the number of bytes we read from the fd, 0 once the other side closed
+ * 
+ *  --> write boundaries are not kept, see sock352_readv
  */
 int sock352_read(int fd, void *buf, int count)
 {
+	struct iovec iov; 
+	iov.iov_base = buf; 
+	iov.iov_len = (count > 0) ? count : 0; 
 
-	printf("in sock352_read()\n");
+	return sock352_readv(fd, &iov, 1); 
+}
+
+/*
+ *  read from the fd into several buffers, filled in order (scatter)
+ *  @param: fd 		-	the fd to read from
+ * 	@param: iov 	- 	the buffers to read to
+ *  @param: iovcnt 	- 	the number of buffers
+ *  @return: the number of bytes we read from the fd, 0 once the other side closed
+ * 
+ *  --> the data is copied straight from the received packets into the 
+ *      buffers
+ *  --> the connection is a byte stream: a read drains as many packets as 
+ *      fit and the unread part of the last one stays for the next read 
+ */
+int sock352_readv(int fd, const struct iovec *iov, int iovcnt)
+{
 	/*
 	 *  Get the socket
 	 */
 	socket352_t *socket; 
 	if((socket = findSocket(&sockets, fd)) == NULL){
-		printf("Failed to load the socket in sock352_read(): %d\n", fd);
+		printf("Failed to load the socket in sock352_readv(): %d\n", fd);
 		return SOCK352_FAILURE;
 	}
 
-	/* 
-	 *  Create the packet to read to 
-	 */
-	packet_t r_packet;
+	iov_cursor_t cursor; 
+	int count = initIovCursor(&cursor, iov, iovcnt); 
+	if(count < 0){
+		printf("Invalid buffers in sock352_readv()\n"); 
+		return SOCK352_FAILURE; 
+	}
 
 	/* 
-	 *  Create the ack packet to respond with 
+	 *  Wait for the engine to queue an in-order data packet 
 	 */
-	packet_t *ack_packet = (packet_t *)calloc(1, sizeof(packet_t));
-	ack_packet->header.version = SOCK352_VER_1; 
-	ack_packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t);
-	ack_packet->header.sequence_no = getSeqNumber(socket);
-	ack_packet->header.flags = SOCK352_ACK; 
+	lockSocket(socket); 
+	while(!hasInOrderPacket(socket)){
+		if(socket->peer_fin){
+			unlockSocket(socket); 
+			return 0; 
+		}
 
-	/* 
-	 *  Read a packet 
-	 */
-	 int bytes_read = 0; 
+		if(socket->error){
+			unlockSocket(socket); 
+			printf("Connection failed in sock352_readv()\n");
+			return SOCK352_FAILURE; 
+		}
 
-	if((bytes_read = recvfrom(socket->sock_fd, &r_packet, sizeof(packet_t), 0, NULL, NULL)) < 0){
-		printf("Failed to receive packet in sock352_read(): %s\n", strerror(errno));
-		return SOCK352_FAILURE; 
+		waitSocket(socket); 
 	}
 
 	/* 
-	 *  Set up ack no
-	 */
-	ack_packet->header.ack_no = r_packet.header.sequence_no; 
-
-	/* 
-	 *  Send ack packet
+	 *  Take the in-order packets that fit whole in the buffers, the first 
+	 *  from where the last read stopped 
 	 */
-	if((sendto(socket->sock_fd, ack_packet, sizeof(packet_t), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in))) < 0){
-		printf("Failed to send ack packet in sock352_read(): %s\n", strerror(errno));
-		return SOCK352_FAILURE; 
+	packet_t *r_packets = NULL, *r_tail = NULL; 
+	uint32_t offset = socket->recv_offset; 
+	int bytes_read = 0; 
+	while(hasInOrderPacket(socket)){
+		int size = peekRecvPacket(socket)->size - ((r_packets == NULL) ? offset : 0); 
+		if(bytes_read + size > count) break; 
+
+		packet_t *r_packet = popRecvPacket(socket); 
+		bytes_read += size; 
+		r_packet->next = NULL; 
+		if(r_tail != NULL) r_tail->next = r_packet; 
+		else r_packets = r_packet; 
+		r_tail = r_packet; 
 	}
+	if(r_packets != NULL) socket->recv_offset = 0; 
+	unlockSocket(socket); 
 
 	/* 
-	 *  Copy the information over into the buffer
+	 *  Copy the information over into the buffers
 	 */
-	memcpy(buf, r_packet.data, count);
+	while(r_packets != NULL){
+		packet_t *r_packet = r_packets; 
+		iovScatter(&cursor, r_packet->data + offset, r_packet->size - offset);
+		offset = 0; 
+
+		/* 
+		 *  Free stuff
+		 */
+		r_packets = r_packet->next; 
+		freePacket(r_packet);
+	}
 
 	/* 
-	 *  Free stuff
+	 *  Fill the rest of the buffers from the next packet and leave what 
+	 *  does not fit for the next read 
 	 */
-	free(ack_packet);
-	//free(r_packet);
+	if(bytes_read < count){
+		packet_t *r_packet = NULL; 
+
+		lockSocket(socket); 
+		if(hasInOrderPacket(socket)){
+			packet_t *head = peekRecvPacket(socket); 
+			int size = head->size - socket->recv_offset; 
+			if(size > count - bytes_read) size = count - bytes_read; 
+
+			iovScatter(&cursor, head->data + socket->recv_offset, size); 
+			bytes_read += size; 
+			socket->recv_offset += size; 
+			if(socket->recv_offset == head->size){
+				r_packet = popRecvPacket(socket); 
+				socket->recv_offset = 0; 
+			}
+		}
+		unlockSocket(socket); 
 
-	printf("payload size: %d\n", ntohs(bytes_read));
+		if(r_packet != NULL) freePacket(r_packet); 
+	}
 
-	return ntohs(r_packet.header.payload_len); 
+	return bytes_read; 
 }
 
 
@@ -633,85 +846,578 @@ int sock352_read(int fd, void *buf, int count)
  *  @param: count	-	the number of bytes that we're writing
  *  @return: the number of bytes written to the fd
  * 
- *  --> write one packet at a time
- *  --> wait for ack 
- *  --> return 	
+ *  --> split the buffer into packets in the send buffer
+ *  --> wait only while the send buffer is full
+ *  --> the engine thread sends them as the window allows 
  */
 int sock352_write(int fd, void *buf, int count)
 {
+	struct iovec iov; 
+	iov.iov_base = buf; 
+	iov.iov_len = (count > 0) ? count : 0; 
+
+	return sock352_writev(fd, &iov, 1); 
+}
 
-	printf("in sock352_write()\n");
+/* 
+ *  write several buffers to the fd as one stream of bytes (gather)
+ *  @param: fd 		-	fd to write to
+ *  @param: iov 	-	the buffers to write, in order
+ *  @param: iovcnt	-	the number of buffers
+ *  @return: the number of bytes written to the fd
+ * 
+ *  --> the packets are filled straight from the buffers (a header, a tag 
+ *      and a payload need no staging copy)
+ */
+int sock352_writev(int fd, const struct iovec *iov, int iovcnt)
+{
 	/* 
 	 *  Get the socket from the connection
 	 */
 	socket352_t *socket; 
 	if((socket = findSocket(&sockets, fd)) == NULL){
-		printf("Failed to find the socket in socket352_write()\n"); 
+		printf("Failed to find the socket in socket352_writev()\n"); 
 		return SOCK352_FAILURE; 
 	}
 
-	/* 
-	 *  Create and set up the send packet struct to be sent
-	 */
-	packet_t *packet = (packet_t *)calloc(1, sizeof(packet_t));
-	memcpy(packet->data, buf, count); /* copy the data from the buf */
+	iov_cursor_t cursor; 
+	int count = initIovCursor(&cursor, iov, iovcnt); 
+	if(count < 0){
+		printf("Invalid buffers in sock352_writev()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	int offset = 0; 
+	while(offset < count){
+		/* 
+		 *  Small writes are coalesced -- top up the partial packet at 
+		 *  the tail of the send buffer if the engine still holds it
+		 */
+		lockSocket(socket); 
+		if(socket->error){
+			unlockSocket(socket); 
+			printf("Connection failed in sock352_writev()\n");
+			return SOCK352_FAILURE;
+		}
+
+		packet_t *tail = socket->send_tail; 
+		if(tail != NULL && packetOpen(socket, tail)){
+			int ready = packetReady(socket, socket->send_queue); 
+
+			int size = socket->mss - tail->size; 
+			if(size > count - offset) size = count - offset; 
+			iovGather(&cursor, tail->data + tail->size, size); 
+			tail->size += size; 
+			tail->header.payload_len = htons(tail->size); 
+			offset += size; 
+
+			if(!ready && packetReady(socket, socket->send_queue)) wakeSocket(socket); 
+			unlockSocket(socket); 
+			continue; 
+		}
+		unlockSocket(socket); 
+
+		/* 
+		 *  Create and set up the send packet struct to be sent
+		 */
+		int size = count - offset; 
+		if(size > socket->mss) size = socket->mss; 
+
+		packet_t *packet = allocPacket(socket); 
+		if(packet == NULL) return SOCK352_FAILURE; 
+		iovGather(&cursor, packet->data, size); /* copy the data from the buffers */
+		packet->size = size; 
+
+		/* 
+		 *  Create and set up the send packet header
+		 */
+		packet->header.version = SOCK352_VER_1; 
+		packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t);
+		packet->header.payload_len = htons(size);
+
+		/* 
+		 *  Wait for room in the send buffer
+		 */
+		lockSocket(socket); 
+		while(socket->n_queued >= socket->window && !socket->error) waitSocket(socket); 
+
+		if(socket->error){
+			unlockSocket(socket); 
+			freePacket(packet); 
+			printf("Connection failed in sock352_writev()\n");
+			return SOCK352_FAILURE;
+		}
+
+		/* 
+		 *  Queue it for the engine -- it only needs waking if nothing in 
+		 *  the buffer could go out before, otherwise it is already 
+		 *  waiting to send (a corked packet needs its cork timer set)
+		 */
+		int ready = socket->send_queue != NULL && packetReady(socket, socket->send_queue); 
+		packet->header.sequence_no = getSeqNumber(socket);
+		packet->queued_usec = nowUsec(); 
+		addSendPacket(socket, packet); 
+		if(!ready && (packetReady(socket, socket->send_queue) || socket->cork)) wakeSocket(socket); 
+		unlockSocket(socket); 
+
+		offset += size; 
+	}
 
 	/* 
-	 *  Create and set up the send packet header
+	 *  Everything Okay. 
 	 */
-	packet->header.version = SOCK352_VER_1; 
-	packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t);
-	packet->header.sequence_no = getSeqNumber(socket);
-	packet->header.payload_len = htons(count);
+	return count; 
 
-	printf("payload size: %d\ncount: %d\n", packet->header.payload_len, count);
+}
 
+/* 
+ *  send part of a file to the fd
+ *  @param: fd 		-	fd to write to
+ *  @param: file_fd	-	the file to send
+ *  @param: offset	-	where in the file to start
+ *  @param: count	-	the number of bytes to send (stops early at the end of the file)
+ *  @return: the number of bytes written to the fd
+ * 
+ *  --> the file is mapped a chunk at a time and the packets are filled 
+ *      straight from the page cache (no read() into a staging buffer)
+ *  --> a file that shrinks is sent up to its new end, its size is checked 
+ *      before each chunk. Truncating it while a chunk is being copied 
+ *      still raises SIGBUS, as with any mapped file -- don't send files 
+ *      other processes may truncate
+ */
+ssize_t sock352_sendfile(int fd, int file_fd, off_t offset, size_t count)
+{
 	/* 
-	 *  Create the recv packet 
+	 *  Never go past the end of the file
 	 */
-	packet_t *r_packet = (packet_t *)calloc(1, sizeof(packet_t));
-
-	int bytes_written; 
-	int packet_sent = 0; 
+	struct stat file_stat; 
+	if(fstat(file_fd, &file_stat) < 0){
+		printf("Failed to stat the file in sock352_sendfile(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
+	if(offset < 0 || offset >= file_stat.st_size) return 0; 
+	if(count > (size_t)(file_stat.st_size - offset)) count = file_stat.st_size - offset; 
 
-	while(packet_sent == 0){
+	off_t page_mask = sysconf(_SC_PAGESIZE) - 1; 
+	size_t bytes_sent = 0; 
+	while(bytes_sent < count){
 		/* 
-		 *  Send the packet 
+		 *  Touching a mapped page past the end of the file is SIGBUS -- 
+		 *  stop at the end if someone truncated it
 		 */
-		if((bytes_written = sendto(socket->sock_fd, packet, sizeof(*packet), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in))) < 0){
-			printf("Failed to write to packet in sock352_write(): %s\n", strerror(errno));
-			return SOCK352_FAILURE;
+		if(bytes_sent > 0 && fstat(file_fd, &file_stat) < 0){
+			printf("Failed to stat the file in sock352_sendfile(): %s\n", strerror(errno)); 
+			return bytes_sent; 
 		}
+		if(offset >= file_stat.st_size) break; 
+		if(count - bytes_sent > (size_t)(file_stat.st_size - offset)) count = bytes_sent + (file_stat.st_size - offset); 
 
 		/* 
-		 *  Receive the ack packet 
+		 *  Map the next chunk (mappings start on a page boundary)
 		 */
-		int bytes_read;
-		if((bytes_read = recvfrom(socket->sock_fd, r_packet, sizeof(packet_t), 0, NULL, NULL)) < 0){
-			printf("Failed to read ack packet in sock352_read(): %s\n", strerror(errno));
-			return SOCK352_FAILURE;
+		size_t size = count - bytes_sent; 
+		if(size > SOCK352_FILE_CHUNK) size = SOCK352_FILE_CHUNK; 
+		off_t start = offset & ~page_mask; 
+		size_t skip = offset - start; 
+
+		char *map = mmap(NULL, skip + size, PROT_READ, MAP_SHARED, file_fd, start); 
+		if(map == MAP_FAILED){
+			printf("Failed to map the file in sock352_sendfile(): %s\n", strerror(errno)); 
+			return (bytes_sent > 0) ? (ssize_t)bytes_sent : SOCK352_FAILURE; 
 		}
+		madvise(map, skip + size, MADV_SEQUENTIAL); 
+
+		struct iovec iov; 
+		iov.iov_base = map + skip; 
+		iov.iov_len = size; 
+		int rc = sock352_writev(fd, &iov, 1); 
+
+		munmap(map, skip + size); 
+		if(rc < 0) return (bytes_sent > 0) ? (ssize_t)bytes_sent : SOCK352_FAILURE; 
+
+		bytes_sent += size; 
+		offset += size; 
+	}
+
+	return bytes_sent; 
+}
+
+/* 
+ *  receive into a file from the fd
+ *  @param: fd 		-	fd to read from
+ *  @param: out_fd	-	the file to write to, open for reading and writing 
+ *  @param: size	-	the number of bytes to receive (stops early if the other side closes)
+ *  @return: the number of bytes written to the file, at its current position 
+ * 
+ *  --> the file is preallocated, then mapped a chunk at a time and the 
+ *      packets are copied straight to their place in the page cache (no 
+ *      staging buffer and no write() per chunk)
+ */
+ssize_t sock352_recvfile(int fd, int out_fd, size_t size)
+{
+	off_t offset; 
+	if((offset = lseek(out_fd, 0, SEEK_CUR)) < 0){
+		printf("Failed to find the file position in sock352_recvfile(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
+	if(size == 0) return 0; 
+
+	/* 
+	 *  Reserve the blocks up front (file systems without fallocate, or 
+	 *  without this mode of it, just get the size) 
+	 */
+	int rc = fallocate(out_fd, 0, offset, size); 
+	if(rc < 0 && (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)){
+		struct stat file_stat; 
+		if((rc = fstat(out_fd, &file_stat)) == 0 && file_stat.st_size < (off_t)(offset + size)) rc = ftruncate(out_fd, offset + size); 
+	}
+	if(rc < 0){
+		printf("Failed to allocate the file in sock352_recvfile(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
 
-		packet_sent = 1; /* say we sent the packet */
+	off_t page_mask = sysconf(_SC_PAGESIZE) - 1; 
+	size_t bytes_received = 0; 
+	int closed = 0; 
+	while(bytes_received < size && !closed){
+		/* 
+		 *  Map the next chunk (mappings start on a page boundary)
+		 */
+		off_t position = offset + bytes_received; 
+		size_t chunk = size - bytes_received; 
+		if(chunk > SOCK352_FILE_CHUNK) chunk = SOCK352_FILE_CHUNK; 
+		off_t start = position & ~page_mask; 
+		size_t skip = position - start; 
+
+		char *map = mmap(NULL, skip + chunk, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, start); 
+		if(map == MAP_FAILED){
+			printf("Failed to map the file in sock352_recvfile(): %s\n", strerror(errno)); 
+			closed = -1; 
+			break; 
+		}
 
 		/* 
-		 *  Confirm the ack number and ack flags
+		 *  Fill it from the connection
 		 */
-		if(r_packet->header.ack_no != packet->header.sequence_no || r_packet->header.flags != SOCK352_ACK){
-			printf("Invalid packet received in sock352_write()\n");
-			return SOCK352_FAILURE; 
+		size_t filled = 0; 
+		while(filled < chunk){
+			struct iovec iov; 
+			iov.iov_base = map + skip + filled; 
+			iov.iov_len = chunk - filled; 
+			int bytes_read = sock352_readv(fd, &iov, 1); 
+			if(bytes_read <= 0){
+				closed = (bytes_read < 0) ? -1 : 1; 
+				break; 
+			}
+			filled += bytes_read; 
 		}
+
+		munmap(map, skip + chunk); 
+		bytes_received += filled; 
 	}
 
 	/* 
-	 *  Free things
+	 *  Don't leave the unused part of the preallocation in the file
 	 */
-	free(packet); 
-	free(r_packet);
+	if(bytes_received < size){
+		struct stat file_stat; 
+		if(fstat(out_fd, &file_stat) == 0 && file_stat.st_size == (off_t)(offset + size)) ftruncate(out_fd, offset + bytes_received); 
+	}
+	lseek(out_fd, offset + bytes_received, SEEK_SET); 
+
+	if(closed < 0 && bytes_received == 0) return SOCK352_FAILURE; 
+	return bytes_received; 
+}
+
+/* 
+ *  sock352_flush
+ * 
+ *  sends whatever is in the send buffer without waiting for more (a 
+ *  partial packet held by Nagle or a cork goes out), doesn't wait for it 
+ *  to be ACKed
+ */
+int sock352_flush(int fd)
+{
+	socket352_t *socket; 
+	if((socket = findSocket(&sockets, fd)) == NULL){
+		printf("Failed to find the socket in sock352_flush()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	lockSocket(socket); 
+	if(socket->error){
+		unlockSocket(socket); 
+		printf("Connection failed in sock352_flush()\n");
+		return SOCK352_FAILURE; 
+	}
+	int ready = socket->send_queue == NULL || packetReady(socket, socket->send_queue); 
+	socket->push_seq = socket->seq_no; 
+	if(!ready) wakeSocket(socket); 
+	unlockSocket(socket); 
+
+	return SOCK352_SUCCESS; 
+}
+
+/* 
+ *  sock352_setsockopt
+ * 
+ *  sets a per-socket protocol option (SOCK352_OPT_*)
+ */
+int sock352_setsockopt(int fd, int option, int value)
+{
+	socket352_t *socket; 
+	if((socket = findSocket(&sockets, fd)) == NULL){
+		printf("Failed to find the socket in sock352_setsockopt()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	lockSocket(socket); 
+	int rc = setSocketOption(socket, option, value); 
+	unlockSocket(socket); 
 
 	/* 
-	 *  Everything Okay. 
+	 *  Uncorking or turning Nagle off may let held data out 
 	 */
-	return count; 
+	if(rc == SOCK352_SUCCESS && (option == SOCK352_OPT_CORK || option == SOCK352_OPT_NODELAY) && socket->state != CLOSED) wakeSocket(socket); 
 
-}
\ No newline at end of file
+	return rc; 
+}
+
+/* 
+ *  sock352_getsockopt
+ * 
+ *  gets a per-socket protocol option (SOCK352_OPT_*)
+ */
+int sock352_getsockopt(int fd, int option, int *value)
+{
+	socket352_t *socket; 
+	if((socket = findSocket(&sockets, fd)) == NULL){
+		printf("Failed to find the socket in sock352_getsockopt()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	lockSocket(socket); 
+	int rc = getSocketOption(socket, option, value); 
+	unlockSocket(socket); 
+
+	return rc; 
+}
+
+/* 
+ *  sock352_getstats
+ * 
+ *  copies out the connection statistics (round trip time estimate, 
+ *  retransmission timeout, packet counters)
+ */
+int sock352_getstats(int fd, sock352_stats_t *stats)
+{
+	socket352_t *socket; 
+	if((socket = findSocket(&sockets, fd)) == NULL){
+		printf("Failed to find the socket in sock352_getstats()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	lockSocket(socket); 
+	*stats = socket->stats; 
+	poolStats(socket, stats); 
+	stats->srtt_usec = socket->srtt; 
+	stats->rttvar_usec = socket->rttvar; 
+	stats->rto_usec = currentRto(socket); 
+	stats->mss = socket->mss; 
+	stats->cwnd = (uint64_t)socket->cc.cwnd; 
+	stats->pacing_rate = socket->pacing ? pacingRate(socket) : 0; 
+	stats->ssthresh = (socket->cc.ssthresh < CC_INITIAL_SSTHRESH) ? (uint64_t)socket->cc.ssthresh : 0; 
+	unlockSocket(socket); 
+
+	return SOCK352_SUCCESS; 
+}
+
+/* 
+ *  sock352_epoll_create
+ * 
+ *  creates a readiness set for sock352 fds and returns its fd 
+ *  -- close it with close()
+ * 
+ *  --> size is only checked (EINVAL unless positive), like epoll_create
+ */
+int sock352_epoll_create(int size)
+{
+	if(size <= 0){
+		printf("Invalid size in sock352_epoll_create(): %d\n", size); 
+		errno = EINVAL; 
+		return SOCK352_FAILURE; 
+	}
+
+	int epfd = epoll_create1(0); 
+	if(epfd < 0){
+		printf("Failed to create the epoll set in sock352_epoll_create(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
+
+	return epfd; 
+}
+
+/* 
+ *  sock352_epoll_ctl
+ * 
+ *  adds, changes or removes a sock352 fd in a readiness set 
+ *  (op is SOCK352_EPOLL_CTL_*, event->events the SOCK352_EPOLL* to report)
+ * 
+ *  --> the socket is watched through an eventfd the engine signals on 
+ *      progress (new connections for a listener)
+ */
+int sock352_epoll_ctl(int epfd, int op, int fd, sock352_epoll_event_t *event)
+{
+	int epoll_op; 
+	switch(op){
+		case SOCK352_EPOLL_CTL_ADD:
+			epoll_op = EPOLL_CTL_ADD; 
+			break; 
+		case SOCK352_EPOLL_CTL_MOD:
+			epoll_op = EPOLL_CTL_MOD; 
+			break; 
+		case SOCK352_EPOLL_CTL_DEL:
+			epoll_op = EPOLL_CTL_DEL; 
+			break; 
+		default:
+			printf("Invalid operation in sock352_epoll_ctl(): %d\n", op); 
+			return SOCK352_FAILURE; 
+	}
+
+	socket352_t *socket; 
+	if((socket = findSocket(&sockets, fd)) == NULL){
+		printf("Failed to find the socket in sock352_epoll_ctl()\n"); 
+		return SOCK352_FAILURE; 
+	}
+
+	/* 
+	 *  Starts signalled so the first wait looks at the socket
+	 */
+	lockSocket(socket); 
+	if(socket->ready_fd < 0 && op != SOCK352_EPOLL_CTL_DEL){
+		socket->ready_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC); 
+		socket->ready_gen++; 
+	}
+	int watch_fd = socket->ready_fd; 
+	uint32_t gen = socket->ready_gen; 
+	unlockSocket(socket); 
+
+	if(watch_fd < 0 && op == SOCK352_EPOLL_CTL_DEL){
+		printf("Socket is not in an epoll set in sock352_epoll_ctl()\n"); 
+		errno = ENOENT; 
+		return SOCK352_FAILURE; 
+	}
+
+	if(watch_fd < 0){
+		printf("Failed to create the eventfd in sock352_epoll_ctl(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
+
+	/* 
+	 *  The events asked for and the eventfd's generation ride along with 
+	 *  the fd -- no state kept here
+	 */
+	struct epoll_event ev; 
+	ev.events = EPOLLIN; 
+	ev.data.u64 = READY_DATA(fd, (event != NULL) ? event->events : 0, gen); 
+
+	if(epoll_ctl(epfd, epoll_op, watch_fd, &ev) < 0){
+		printf("Failed to change the epoll set in sock352_epoll_ctl(): %s\n", strerror(errno)); 
+		return SOCK352_FAILURE; 
+	}
+
+	return SOCK352_SUCCESS; 
+}
+
+/* 
+ *  sock352_epoll_wait
+ * 
+ *  waits up to timeout milli-seconds (-1 forever, 0 not at all) for the 
+ *  fds in the set to become ready, returns the number of events filled in 
+ * 
+ *  --> only the sockets the engine signalled are looked at, so the cost 
+ *      follows the number of active connections, not the size of the set
+ *  --> level triggered: a socket that is still ready stays signalled
+ */
+int sock352_epoll_wait(int epfd, sock352_epoll_event_t *events, int maxevents, int timeout)
+{
+	if(maxevents <= 0){
+		printf("Invalid maxevents in sock352_epoll_wait(): %d\n", maxevents); 
+		return SOCK352_FAILURE; 
+	}
+
+	struct epoll_event *signalled = (struct epoll_event *)malloc(maxevents * sizeof(struct epoll_event)); 
+	if(signalled == NULL){
+		printf("Failed to allocate the events in sock352_epoll_wait(): %s\n", strerror(errno)); 
+		errno = ENOMEM; 
+		return SOCK352_FAILURE; 
+	}
+	uint64_t deadline = (timeout > 0) ? nowUsec() + (uint64_t)timeout * 1000 : 0; 
+	int n_events = 0; 
+
+	while(1){
+		int wait = timeout; 
+		if(timeout > 0){
+			uint64_t now = nowUsec(); 
+			wait = (deadline > now) ? (int)((deadline - now + 999) / 1000) : 0; 
+		}
+
+		int n = epoll_wait(epfd, signalled, maxevents, wait); 
+		if(n < 0){
+			if(errno == EINTR) continue; 
+			printf("Failed to wait on the epoll set in sock352_epoll_wait(): %s\n", strerror(errno)); 
+			free(signalled); 
+			return SOCK352_FAILURE; 
+		}
+
+		int i=0; 
+		for(;i<n;i++){
+			int fd = READY_FD(signalled[i].data.u64); 
+			uint32_t wanted = READY_EVENTS(signalled[i].data.u64) | SOCK352_EPOLLERR; 
+
+			socket352_t *socket; 
+			if((socket = findSocket(&sockets, fd)) == NULL) continue; 
+
+			/* 
+			 *  The socket was closed (or its eventfd replaced) since the 
+			 *  signal -- nothing to report
+			 */
+			lockSocket(socket); 
+			if(socket->ready_fd < 0 || (socket->ready_gen & READY_GEN_MASK) != READY_GEN(signalled[i].data.u64)){
+				unlockSocket(socket); 
+				continue; 
+			}
+
+			/* 
+			 *  Consume the signal, then look at the buffers -- signal it 
+			 *  again if something is still ready so the next wait sees it
+			 */
+			uint32_t ready; 
+			uint64_t count; 
+			if(read(socket->ready_fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+				printf("Failed to read the eventfd in sock352_epoll_wait(): %s\n", strerror(errno)); 
+			}
+			if((ready = socketReadiness(socket) & wanted) != 0){
+				uint64_t one = 1; 
+				if(write(socket->ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+					printf("Failed to signal the socket in sock352_epoll_wait(): %s\n", strerror(errno)); 
+				}
+			}
+			unlockSocket(socket); 
+
+			if(ready != 0){
+				events[n_events].events = ready; 
+				events[n_events].fd = fd; 
+				n_events++; 
+			}
+		}
+
+		/* 
+		 *  Only stale signals -- keep waiting out the timeout
+		 */
+		if(n_events > 0 || n == 0 || timeout == 0) break; 
+	}
+
+	free(signalled); 
+	return n_events; 
+}
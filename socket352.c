@@ -1,9 +1,18 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/udp.h>
+#include <sys/random.h>
+#include <limits.h>
 #include "uthash.h"
 #include "sock352.h"
 #include "packet.c"
+#include "congestion352.c"
+#include "checksum352.c"
 
 /* 
  * Connection States
@@ -20,6 +29,128 @@
 #define SYN_SENT 10 /* client - sent a syn packet to server */
 #define LISTEN 11 /* server - listening for any incoming connections */
 
+/* 
+ * Default cap on the number of packets in flight (the congestion window 
+ * decides how many are actually sent)
+ */
+#define SOCK352_DEFAULT_WINDOW 64
+
+/* 
+ * Size requested for the kernel send/receive buffers of the UDP socket
+ */
+#define SOCK352_SOCKET_BUFFER (4*1024*1024)
+
+/* 
+ * Retransmission timeout bounds (micro-seconds) and retry limits
+ */
+#define SOCK352_INITIAL_RTO 1000000
+#define SOCK352_MIN_RTO 10000
+#define SOCK352_MAX_RTO 60000000
+#define SOCK352_MAX_RETRIES 12 /* consecutive timeouts before the connection is dead */
+#define SOCK352_FIN_RETRIES 3 /* timeouts on our FIN once the other side already closed */
+#define SOCK352_SYN_TIMEOUT 3000000 /* a half-open connection is dropped after this long (usec) */
+#define SOCK352_SYN_RETRIES 5 /* SYN retransmissions before connect gives up */
+
+/* 
+ * Delayed ACKs -- in-order data is ACKed every SOCK352_DEFAULT_ACK_EVERY 
+ * packets or after SOCK352_DEFAULT_ACK_DELAY usec (well below the min RTO) 
+ */
+#define SOCK352_DEFAULT_ACK_EVERY 2
+#define SOCK352_DEFAULT_ACK_DELAY 2000
+
+/* 
+ * SYN cookies -- the SYN|ACK sequence number is an 8-bit time slot over a 
+ * 40-bit keyed hash of the client, which leaves 2^63 sequence numbers 
+ * before the counter could wrap 
+ */
+#define SOCK352_COOKIE_SLOT SOCK352_SYN_TIMEOUT /* a cookie is good for one to two slots (usec) */
+#define SOCK352_COOKIE_HASH_BITS 40
+
+/* 
+ * Fast open -- a listener only takes the data in a SYN that carries the 
+ * client's cookie, and a connection accepted on it sends at most this 
+ * many packets before the client's ACK; clients keep the cookies of the 
+ * last few servers 
+ */
+#define SOCK352_SYN_DATA_PACKETS 4
+#define SOCK352_FASTOPEN_CACHE 16
+
+/* 
+ * Number of SACKed packets above a hole before the hole is considered lost 
+ */
+#define SOCK352_DUP_THRESH 3
+
+/* 
+ * Pacing gains (percent of cwnd per round trip), as in Linux: ahead of 
+ * the window in slow start so it can still double, a little ahead in 
+ * congestion avoidance 
+ */
+#define SOCK352_PACING_SS_GAIN 200
+#define SOCK352_PACING_CA_GAIN 120
+
+/* 
+ * Max datagrams per sendmmsg/recvmmsg call
+ */
+#define SOCK352_BATCH_SIZE 64
+
+/* 
+ * Max size of a UDP GSO super-buffer (the kernel splits it into datagrams)
+ */
+#define SOCK352_GSO_BUFFER 65000
+
+/* 
+ * Receive ring -- a power of two of slots indexed by sequence number, 
+ * doubled when a packet lands past its end 
+ */
+#define SOCK352_RECV_RING_MIN 256
+#define SOCK352_RECV_RING_MAX (1 << 17)
+
+/* 
+ * Bytes of free packets the packet pool keeps -- each is room for the 
+ * largest payload but only the bytes its payloads touched count, so at 
+ * a 1472 byte MSS the pool holds about 2700 packets, at the largest 
+ * about 64 
+ */
+#define SOCK352_POOL_BYTES (4*1024*1024)
+
+/* 
+ * Path MTU discovery (RFC 8899 style) -- connections start at a payload 
+ * that fits a 1200-byte datagram and probe the larger sizes in 
+ * mtu_probe_sizes, padded and with DF set 
+ */
+#define SOCK352_BASE_MSS (1200 - (int)sizeof(sock352_pkt_hdr_t))
+#define SOCK352_MIN_MSS 64
+#define SOCK352_MAX_PROBES 3 /* unanswered probes before a size is given up */
+
+/* 
+ * Longest a corked partial packet is held (usec), as in Linux 
+ */
+#define SOCK352_CORK_TIMEOUT 200000
+
+/* 
+ * UDP GRO receive buffers (each holds up to 64 KB of coalesced datagrams)
+ */
+#define SOCK352_GRO_BUFFERS 8
+#define SOCK352_GRO_BUFFER 65536
+
+/* 
+ * sock352_sendfile/sock352_recvfile map the file this many bytes at a time 
+ */
+#define SOCK352_FILE_CHUNK (16*1024*1024)
+
+
+/* 
+ * Key of a connection in its listener's demux table -- the client's IP 
+ * address and UDP port and the CS352 port in its packets' source_port 
+ * (as they arrive, network byte order) 
+ */
+struct demux_key{
+    uint32_t addr; 
+    uint32_t port; 
+    uint32_t cs352_port; 
+}; 
+
+typedef struct demux_key demux_key_t; 
 
 /* 
  * Socket (connection) structure 
@@ -30,22 +161,157 @@ struct socket352{
     int local_port; /* port number of self */
     int remote_port; /* port number of other */
     int sock_fd; /* open (actual) socket file descriptor (local) */
-    int seq_no; /* the NEXT sequence number */
-    int n_connections; /* the number of connections in total */
-    int *connections; /* the fds of the sockets that connected to the server */
+    uint64_t seq_no; /* the NEXT sequence number */
+    uint64_t recv_next; /* the next in-order sequence number expected from the other */
+    int peer_fin; /* set once the other side's FIN has been received in order */
+    int window; /* max number of unacknowledged packets in flight */
+    int n_unacked; /* number of packets currently in the transmit list */
+    int n_sacked; /* number of packets in the transmit list that were SACKed */
+    int n_lost; /* number of packets in the transmit list marked lost, not yet resent */
+    congestion352_t cc; /* congestion control state */
+    uint64_t recovery_point; /* losses below this sequence number belong to the current loss event */
+    int rto_recovery; /* the current loss event came from a timeout (slow start during recovery) */
+    int pacing; /* spread packets over the round trip instead of sending bursts */
+    uint64_t pace_next; /* earliest time the next packet may be sent (usec) */
+    uint64_t kernel_pacing_rate; /* last SO_MAX_PACING_RATE given to the kernel (bytes/sec) */
+    uint64_t srtt; /* smoothed round trip time (usec), 0 until the first sample */
+    uint64_t rttvar; /* round trip time variance (usec) */
+    uint64_t rto; /* retransmission timeout from the RTT estimate (usec), before backoff */
+    uint64_t rto_deadline; /* when the retransmission timer fires (usec), 0 if not armed */
+    int backoffs; /* consecutive timeouts without progress -- the RTO is doubled for each */
+    int loss_rate; /* percent of outgoing packets to drop (loss emulation) */
+    int sack; /* send selective acknowledgements for out of order packets */
+    sock352_stats_t stats; /* connection statistics */
+    uint64_t pool_hits; /* packets allocated from the pool (protected by the pool mutex) */
+    uint64_t pool_misses; /* packets allocated from the heap (protected by the pool mutex) */
+    int n_connections; /* listener -- max connections handshaking or waiting for sock352_accept (the listen backlog) */
+    int is_listener; /* routes packets to the connections in its demux table -- still once closed, until the last of them is */
+    struct socket352 *demux; /* listener -- its connections, keyed by demux_key */
+    struct socket352 *pending; /* listener -- half-open connections (SYN|ACK sent, fast open ones too), oldest first */
+    struct socket352 *pending_tail; /* listener -- tail of the half-open list */
+    int n_pending; /* listener -- number of half-open connections, not counting those already in the accept queue (fast open) */
+    struct socket352 *accept_queue; /* listener -- established connections for sock352_accept, oldest first */
+    struct socket352 *accept_tail; /* listener -- tail of the accept queue */
+    int n_accept; /* listener -- number of connections in the accept queue */
+    struct socket352 *queue_next; /* next in the listener's accept queue */
+    struct socket352 *queue_prev; /* previous in the listener's accept queue */
+    struct socket352 *pending_next; /* next in the listener's half-open list */
+    struct socket352 *pending_prev; /* previous in the listener's half-open list */
+    uint64_t syn_usec; /* when the SYN|ACK was sent (usec), 0 for a connection made from a SYN cookie */
+    uint64_t syn_seq; /* sequence number of our SYN|ACK, to send it again */
+    int fast_open; /* queued for accept on the data in its SYN, before the handshake finished */
+    int syn_cookies; /* listener -- when to answer SYNs with cookies (SOCK352_OPT_SYNCOOKIES) */
+    uint64_t cookie_secret[2]; /* listener -- key of the cookie hash */
+    struct socket352 *routed[SOCK352_BATCH_SIZE]; /* listener -- connections that got packets in this receive batch */
+    int n_routed; /* listener -- number of them */
+    struct socket352 *listener; /* the listener whose UDP socket the connection shares, NULL if it has its own */
+    demux_key_t demux_key; /* key in the listener's demux table */
+    int is_routed; /* in the listener's routed list */
     struct sockaddr_in *other; /* the "end" or "dest" of the connection */
     struct sockaddr_in *local; /* the local end of the connection */
-    pthread_mutex_t *mutex; /* mutex for the connection */
+    pthread_mutex_t *mutex; /* mutex for the connection (shared by the app and the engine thread) */
+    pthread_cond_t *cond; /* signaled by the engine whenever the connection makes progress */
+    int error; /* set by the engine when the connection died */
+    packet_t *send_queue; /* send buffer -- packets written by the app, not sent yet */
+    packet_t *send_tail; /* send buffer -- tail of the list */
+    int n_queued; /* number of packets in the send buffer */
     packet_t *unack_packets; /* transmit list -- points to the head of the list */
-    packet_t *recv_packets; /* received list (either acks or actual data) */
+    packet_t *unack_tail; /* transmit list -- points to the tail of the list */
+    packet_t **recv_ring; /* received packets by sequence number -- [recv_head, recv_next) is in order, the rest is out of order (allocated on first use) */
+    uint64_t *recv_map; /* presence bitmap of the ring slots */
+    uint64_t recv_size; /* number of ring slots (a power of two) */
+    uint64_t recv_head; /* oldest packet the app hasn't read */
+    uint64_t recv_high; /* one past the highest sequence number in the ring */
+    packet_t *tx_batch[SOCK352_BATCH_SIZE]; /* packets waiting for the next sendmmsg */
+    int tx_owned[SOCK352_BATCH_SIZE]; /* free the packet once it is sent (ACKs) */
+    int n_tx; /* number of packets in the send batch */
+    packet_t *rx_batch[SOCK352_BATCH_SIZE]; /* receive buffers for recvmmsg */
+    int gso; /* send batches as UDP GSO super-buffers */
+    char *gso_buffer; /* the super-buffer, allocated on first use */
+    int gro; /* receive coalesced datagrams with UDP GRO */
+    int gro_on; /* UDP_GRO is turned on for sock_fd */
+    char *gro_buffers; /* SOCK352_GRO_BUFFERS receive buffers, allocated on first use */
+    int ack_pending; /* data arrived since the last ACK */
+    int ack_now; /* the pending ACK goes out at the end of the receive batch (out of order data, a FIN, ack_every reached) */
+    int rx_unacked; /* in-order data packets since the last ACK */
+    int ack_every; /* ACK at least every ack_every in-order data packets */
+    uint64_t ack_delay; /* usec a pending ACK may wait, 0 for none */
+    uint64_t ack_deadline; /* when the delayed ACK goes out (usec), 0 if none */
+    packet_t *ack_packet; /* the ACK, reused (allocated on first use) */
+    int mss; /* payload bytes per packet sock352_write uses */
+    int mss_option; /* SOCK352_OPT_MSS -- a fixed MSS, 0 to probe for it */
+    int probe_size; /* datagram size of the outstanding MTU probe, 0 if none */
+    int probe_count; /* probes sent at probe_size */
+    int probe_index; /* next entry of mtu_probe_sizes to try, -1 once the search is over */
+    uint64_t probe_deadline; /* when the next probe goes out (usec), 0 if none */
+    packet_t *probe_packet; /* the probe, reused (allocated on first use) */
+    int nodelay; /* SOCK352_OPT_NODELAY -- don't hold a partial packet while data is in flight */
+    int cork; /* SOCK352_OPT_CORK -- hold partial packets until uncorked, flushed or full */
+    uint64_t push_seq; /* packets below this sequence number go out even if partial (flushed) */
+    uint32_t recv_offset; /* bytes of the oldest unread packet the app already read */
+    uint32_t revents; /* epoll events the engine saw on sock_fd this pass */
+    int in_engine; /* owned by the engine thread (from engineAdd to engineRemove) -- set under the engine mutex and the socket lock */
+    int timer_index; /* position in the engine's timer heap, -1 if the socket needs no timer */
+    uint64_t timer_deadline; /* when the engine next needs the socket (usec), its key in the timer heap */
+    int is_due; /* picked for the engine's current pass */
+    int is_busy; /* the engine is processing it outside the engine mutex -- engineRemove waits for it */
+    int is_woken; /* on the engine's wake list (the app changed something the engine acts on) */
+    struct socket352 *wake_next; /* next on the engine's wake list */
+    int ready_fd; /* eventfd signalled on progress, for sock352_epoll_wait (-1 until the socket joins an epoll set) */
+    uint32_t ready_gen; /* bumped whenever ready_fd is created or closed -- signals of an older one are stale */
     UT_hash_handle hh; /* makes the struct hashable */
+    UT_hash_handle demux_hh; /* makes the struct hashable in a listener's demux table */
 }; 
 
 typedef struct socket352 socket352_t; 
 
+int flushBatch(socket352_t *socket); 
+int setGro(socket352_t *socket, int on); 
+
 
 /* Socket functions */
 
+/* 
+ * Initialize the mutex 
+ */
+int initMutex(socket352_t *socket){
+    return pthread_mutex_init(socket->mutex, NULL);
+}
+
+/* 
+ * Lock the socket
+ */
+int lockSocket(socket352_t *socket){
+    return pthread_mutex_lock(socket->mutex); 
+}
+
+/* 
+ * Unlock the socket
+ */
+int unlockSocket(socket352_t *socket){
+    return pthread_mutex_unlock(socket->mutex); 
+}
+
+/* 
+ * Wait (with the socket locked) for the engine to signal progress 
+ */
+int waitSocket(socket352_t *socket){
+    return pthread_cond_wait(socket->cond, socket->mutex); 
+}
+
+/* 
+ * Wake up everyone waiting on the socket (and the epoll sets it is in) 
+ */
+int signalSocket(socket352_t *socket){
+    if(socket->ready_fd >= 0){
+        uint64_t one = 1; 
+        if(write(socket->ready_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+            printf("Failed to signal the socket in signalSocket(): %s\n", strerror(errno)); 
+        }
+    }
+    return pthread_cond_broadcast(socket->cond); 
+}
+
 /* 
  * Initialize a new socket 
  */
@@ -56,116 +322,2322 @@ int initSocket(socket352_t *socket){
     socket->remote_port = -1; 
     socket->sock_fd = -1; 
     socket->seq_no = 0; 
+    socket->recv_next = 0; 
+    socket->peer_fin = 0; 
+    socket->window = SOCK352_DEFAULT_WINDOW; 
+    socket->n_unacked = 0; 
+    socket->n_sacked = 0; 
+    socket->n_lost = 0; 
+    setCcAlgorithm(&socket->cc, CC_DEFAULT_ALGORITHM); 
+    socket->recovery_point = 0; 
+    socket->rto_recovery = 0; 
+    socket->pacing = 1; 
+    socket->pace_next = 0; 
+    socket->kernel_pacing_rate = 0; 
+    socket->srtt = 0; 
+    socket->rttvar = 0; 
+    socket->rto = SOCK352_INITIAL_RTO; 
+    socket->rto_deadline = 0; 
+    socket->backoffs = 0; 
+    socket->loss_rate = 0; 
+    socket->sack = 1; 
+    memset(&socket->stats, 0, sizeof(sock352_stats_t)); 
+    socket->pool_hits = 0; 
+    socket->pool_misses = 0; 
     socket->n_connections = 0; 
-    socket->connections = NULL;
+    socket->is_listener = 0; 
+    socket->demux = NULL; 
+    socket->pending = NULL; 
+    socket->pending_tail = NULL; 
+    socket->n_pending = 0; 
+    socket->accept_queue = NULL; 
+    socket->accept_tail = NULL; 
+    socket->n_accept = 0; 
+    socket->queue_next = NULL; 
+    socket->queue_prev = NULL; 
+    socket->pending_next = NULL; 
+    socket->pending_prev = NULL; 
+    socket->syn_usec = 0; 
+    socket->syn_seq = 0; 
+    socket->fast_open = 0; 
+    socket->syn_cookies = 0; 
+    socket->cookie_secret[0] = socket->cookie_secret[1] = 0; 
+    socket->n_routed = 0; 
+    socket->listener = NULL; 
+    memset(&socket->demux_key, 0, sizeof(demux_key_t)); 
+    socket->is_routed = 0; 
     socket->other = NULL; 
+    socket->mutex = (pthread_mutex_t *)calloc(1, sizeof(pthread_mutex_t)); 
+    initMutex(socket); 
+    socket->cond = (pthread_cond_t *)calloc(1, sizeof(pthread_cond_t)); 
+    pthread_cond_init(socket->cond, NULL); 
+    socket->error = 0; 
+    socket->send_queue = NULL; 
+    socket->send_tail = NULL; 
+    socket->n_queued = 0; 
+    socket->n_tx = 0; 
+    memset(socket->rx_batch, 0, sizeof(socket->rx_batch)); 
+    socket->gso = 0; 
+    socket->gso_buffer = NULL; 
+    socket->gro = 0; 
+    socket->gro_on = 0; 
+    socket->gro_buffers = NULL; 
+    socket->ack_pending = 0; 
+    socket->ack_now = 0; 
+    socket->rx_unacked = 0; 
+    socket->ack_every = SOCK352_DEFAULT_ACK_EVERY; 
+    socket->ack_delay = SOCK352_DEFAULT_ACK_DELAY; 
+    socket->ack_deadline = 0; 
+    socket->ack_packet = NULL; 
+    socket->mss = SOCK352_BASE_MSS; 
+    socket->mss_option = 0; 
+    socket->probe_size = 0; 
+    socket->probe_count = 0; 
+    socket->probe_index = 0; 
+    socket->probe_deadline = 0; 
+    socket->probe_packet = NULL; 
+    socket->nodelay = 0; 
+    socket->cork = 0; 
+    socket->push_seq = 0; 
+    socket->recv_offset = 0; 
+    socket->revents = 0; 
+    socket->in_engine = 0; 
+    socket->timer_index = -1; 
+    socket->timer_deadline = 0; 
+    socket->is_due = 0; 
+    socket->is_busy = 0; 
+    socket->is_woken = 0; 
+    socket->wake_next = NULL; 
+    socket->ready_fd = -1; 
+    socket->ready_gen = 0; 
     socket->unack_packets = NULL;
-    socket->recv_packets = NULL; 
+    socket->unack_tail = NULL;
+    socket->recv_ring = NULL; 
+    socket->recv_map = NULL; 
+    socket->recv_size = 0; 
+    socket->recv_head = 0; 
+    socket->recv_high = 0; 
     return 0; 
 }
 
 /* 
- * Add a packet to the transmit list 
+ * Create a new socket with the ports and options of another 
  */
-int addTransPacket(socket352_t *socket, packet_t *packet){
-    /* 
-     * Get to the end of transmit list
-     */
-    packet_t *ptr = socket->unack_packets; 
+socket352_t * newSocket(socket352_t *settings){
+    socket352_t *socket = (socket352_t *)calloc(1, sizeof(socket352_t)); 
+    initSocket(socket); 
 
-    /* Check if the first packet is set up */
-    if(ptr->size == -1){
-        ptr = packet; 
-        return 0; 
-    }
+    socket->local_port = settings->local_port; 
+    socket->remote_port = settings->remote_port; 
+    socket->window = settings->window; 
+    socket->loss_rate = settings->loss_rate; 
+    socket->sack = settings->sack; 
+    setCcAlgorithm(&socket->cc, settings->cc.algorithm); 
+    socket->pacing = settings->pacing; 
+    socket->gso = settings->gso; 
+    socket->gro = settings->gro; 
+    socket->syn_cookies = settings->syn_cookies; 
+    socket->ack_every = settings->ack_every; 
+    socket->ack_delay = settings->ack_delay; 
+    socket->mss = settings->mss; 
+    socket->mss_option = settings->mss_option; 
+    socket->nodelay = settings->nodelay; 
 
-    while(ptr->next != NULL) ptr = ptr->next; 
+    return socket; 
+}
 
-    /* 
-     * Add packet to list 
-     */
-    ptr->next = packet; 
-    ptr->prev = ptr; 
-    ptr->next = NULL; 
+/* 
+ * Load socket options from the environment (SOCK352_<OPTION>=<value>)
+ */
+int loadEnvOptions(socket352_t *socket, char *env_p[]){
+    if(env_p == NULL) return 0; 
 
+    int i=0; 
+    for(;env_p[i] != NULL;i++){
+        if(strncmp(env_p[i], "SOCK352_WINDOW=", 15) == 0){
+            int window = atoi(env_p[i] + 15); 
+            if(window > 0) socket->window = window; 
+        }
+        else if(strncmp(env_p[i], "SOCK352_LOSS=", 13) == 0){
+            int loss_rate = atoi(env_p[i] + 13); 
+            if(loss_rate >= 0 && loss_rate < 100) socket->loss_rate = loss_rate; 
+        }
+        else if(strncmp(env_p[i], "SOCK352_SACK=", 13) == 0){
+            socket->sack = (atoi(env_p[i] + 13) != 0); 
+        }
+        else if(strncmp(env_p[i], "SOCK352_CC=", 11) == 0){
+            const cc_algorithm_t *algorithm = findCcAlgorithmByName(env_p[i] + 11); 
+            if(algorithm != NULL) setCcAlgorithm(&socket->cc, algorithm); 
+        }
+        else if(strncmp(env_p[i], "SOCK352_PACING=", 15) == 0){
+            socket->pacing = (atoi(env_p[i] + 15) != 0); 
+        }
+        else if(strncmp(env_p[i], "SOCK352_GSO=", 12) == 0){
+            socket->gso = (atoi(env_p[i] + 12) != 0); 
+        }
+        else if(strncmp(env_p[i], "SOCK352_GRO=", 12) == 0){
+            socket->gro = (atoi(env_p[i] + 12) != 0); 
+        }
+        else if(strncmp(env_p[i], "SOCK352_SYNCOOKIES=", 19) == 0){
+            int syn_cookies = atoi(env_p[i] + 19); 
+            if(syn_cookies >= 0 && syn_cookies <= 2) socket->syn_cookies = syn_cookies; 
+        }
+        else if(strncmp(env_p[i], "SOCK352_ACK_EVERY=", 18) == 0){
+            int ack_every = atoi(env_p[i] + 18); 
+            if(ack_every > 0) socket->ack_every = ack_every; 
+        }
+        else if(strncmp(env_p[i], "SOCK352_ACK_DELAY=", 18) == 0){
+            int ack_delay = atoi(env_p[i] + 18); 
+            if(ack_delay >= 0) socket->ack_delay = ack_delay; 
+        }
+        else if(strncmp(env_p[i], "SOCK352_MSS=", 12) == 0){
+            int mss = atoi(env_p[i] + 12); 
+            if(mss == 0 || (mss >= SOCK352_MIN_MSS && mss <= MAX_DATA_SIZE)){
+                socket->mss_option = mss; 
+                socket->mss = (mss != 0) ? mss : SOCK352_BASE_MSS; 
+            }
+        }
+        else if(strncmp(env_p[i], "SOCK352_NODELAY=", 16) == 0){
+            socket->nodelay = (atoi(env_p[i] + 16) != 0); 
+        }
+    }
     return 0; 
 }
 
 /* 
- * Remove packet from the transmit list 
+ * Set a socket option (SOCK352_OPT_*)
  */
-int removeTransPacket(socket352_t *socket, packet_t *packet){
+int setSocketOption(socket352_t *socket, int option, int value){
+    switch(option){
+        case SOCK352_OPT_WINDOW:
+            if(value <= 0) return SOCK352_FAILURE; 
+            socket->window = value; 
+            break; 
+        case SOCK352_OPT_LOSS:
+            if(value < 0 || value >= 100) return SOCK352_FAILURE; 
+            socket->loss_rate = value; 
+            break; 
+        case SOCK352_OPT_SACK:
+            socket->sack = (value != 0); 
+            break; 
+        case SOCK352_OPT_CC:
+            if(findCcAlgorithm(value) == NULL) return SOCK352_FAILURE; 
+            setCcAlgorithm(&socket->cc, findCcAlgorithm(value)); 
+            break; 
+        case SOCK352_OPT_PACING:
+            socket->pacing = (value != 0); 
+            break; 
+        case SOCK352_OPT_GSO:
+            socket->gso = (value != 0); 
+            break; 
+        case SOCK352_OPT_GRO:
+            socket->gro = (value != 0); 
+            if(!socket->gro && socket->gro_on && setGro(socket, 0) < 0) return SOCK352_FAILURE; 
+            break; 
+        case SOCK352_OPT_SYNCOOKIES:
+            if(value < 0 || value > 2) return SOCK352_FAILURE; 
+            socket->syn_cookies = value; 
+            break; 
+        case SOCK352_OPT_ACK_EVERY:
+            if(value <= 0) return SOCK352_FAILURE; 
+            socket->ack_every = value; 
+            break; 
+        case SOCK352_OPT_ACK_DELAY:
+            if(value < 0) return SOCK352_FAILURE; 
+            socket->ack_delay = value; 
+            break; 
+        case SOCK352_OPT_MSS:
+            if(value != 0 && (value < SOCK352_MIN_MSS || value > MAX_DATA_SIZE)) return SOCK352_FAILURE; 
+            socket->mss_option = value; 
+            socket->mss = (value != 0) ? value : SOCK352_BASE_MSS; 
+            break; 
+        case SOCK352_OPT_NODELAY:
+            socket->nodelay = (value != 0); 
+            if(socket->nodelay) socket->push_seq = socket->seq_no; 
+            break; 
+        case SOCK352_OPT_CORK:
+            socket->cork = (value != 0); 
+            if(!socket->cork) socket->push_seq = socket->seq_no; 
+            break; 
+        default:
+            printf("Unknown option in setSocketOption(): %d\n", option); 
+            return SOCK352_FAILURE; 
+    }
 
-    if(socket->unack_packets == packet){
-        packet_t *temp = socket->unack_packets; 
-        socket->unack_packets = temp->next; 
-        free(temp);
-        return 0; 
+    return SOCK352_SUCCESS; 
+}
+
+/* 
+ * Get a socket option (SOCK352_OPT_*)
+ */
+int getSocketOption(socket352_t *socket, int option, int *value){
+    switch(option){
+        case SOCK352_OPT_WINDOW:
+            *value = socket->window; 
+            break; 
+        case SOCK352_OPT_LOSS:
+            *value = socket->loss_rate; 
+            break; 
+        case SOCK352_OPT_SACK:
+            *value = socket->sack; 
+            break; 
+        case SOCK352_OPT_CC:
+            *value = socket->cc.algorithm->id; 
+            break; 
+        case SOCK352_OPT_PACING:
+            *value = socket->pacing; 
+            break; 
+        case SOCK352_OPT_GSO:
+            *value = socket->gso; 
+            break; 
+        case SOCK352_OPT_GRO:
+            *value = socket->gro; 
+            break; 
+        case SOCK352_OPT_SYNCOOKIES:
+            *value = socket->syn_cookies; 
+            break; 
+        case SOCK352_OPT_ACK_EVERY:
+            *value = socket->ack_every; 
+            break; 
+        case SOCK352_OPT_ACK_DELAY:
+            *value = (int)socket->ack_delay; 
+            break; 
+        case SOCK352_OPT_MSS:
+            *value = socket->mss_option; 
+            break; 
+        case SOCK352_OPT_NODELAY:
+            *value = socket->nodelay; 
+            break; 
+        case SOCK352_OPT_CORK:
+            *value = socket->cork; 
+            break; 
+        default:
+            printf("Unknown option in getSocketOption(): %d\n", option); 
+            return SOCK352_FAILURE; 
     }
 
-    packet_t *ptr = socket->unack_packets; 
-    while(ptr != NULL){
-        if(ptr == packet){
-            if(ptr->prev) ptr->prev->next = ptr->next; 
-            if(ptr->next) ptr->next->prev = ptr->prev; 
-            free(ptr);
-            return 0; 
+    return SOCK352_SUCCESS; 
+}
+
+/* Scatter/gather */
+
+/* 
+ * Position in an app's iovec array 
+ */
+struct iov_cursor{
+    const struct iovec *iov; /* the app's buffers */
+    int iovcnt; /* number of buffers */
+    int index; /* buffer the next byte goes to or comes from */
+    size_t offset; /* bytes of that buffer already used */
+}; 
+
+typedef struct iov_cursor iov_cursor_t; 
+
+/* 
+ * Start a cursor at the first byte of an iovec array 
+ * returns the total length, -1 if the array is invalid or holds more 
+ * than INT_MAX bytes (the most a read or write can return)
+ */
+int initIovCursor(iov_cursor_t *cursor, const struct iovec *iov, int iovcnt){
+    if(iovcnt < 0 || iovcnt > IOV_MAX || (iovcnt > 0 && iov == NULL)) return SOCK352_FAILURE; 
+
+    size_t total = 0; 
+    int i=0; 
+    for(;i<iovcnt;i++){
+        if(iov[i].iov_len > 0 && iov[i].iov_base == NULL) return SOCK352_FAILURE; 
+        if(iov[i].iov_len > INT_MAX - total) return SOCK352_FAILURE; 
+        total += iov[i].iov_len; 
+    }
+
+    cursor->iov = iov; 
+    cursor->iovcnt = iovcnt; 
+    cursor->index = 0; 
+    cursor->offset = 0; 
+    return (int)total; 
+}
+
+/* 
+ * Copy the next n bytes of the app's buffers to dst (gather) 
+ */
+int iovGather(iov_cursor_t *cursor, char *dst, int n){
+    while(n > 0){
+        const struct iovec *iov = &cursor->iov[cursor->index]; 
+        size_t size = iov->iov_len - cursor->offset; 
+        if(size > (size_t)n) size = n; 
+
+        memcpy(dst, (char *)iov->iov_base + cursor->offset, size); 
+        dst += size; 
+        n -= size; 
+        cursor->offset += size; 
+        if(cursor->offset == iov->iov_len){
+            cursor->index++; 
+            cursor->offset = 0; 
         }
     }
-    return -1; /* could not find the packet in the list */
+    return 0; 
 }
 
-int addRecvPacket(socket352_t *socket, packet_t *packet){
+/* 
+ * Copy n bytes from src to the next bytes of the app's buffers (scatter) 
+ */
+int iovScatter(iov_cursor_t *cursor, const char *src, int n){
+    while(n > 0){
+        const struct iovec *iov = &cursor->iov[cursor->index]; 
+        size_t size = iov->iov_len - cursor->offset; 
+        if(size > (size_t)n) size = n; 
+
+        memcpy((char *)iov->iov_base + cursor->offset, src, size); 
+        src += size; 
+        n -= size; 
+        cursor->offset += size; 
+        if(cursor->offset == iov->iov_len){
+            cursor->index++; 
+            cursor->offset = 0; 
+        }
+    }
+    return 0; 
+}
+
+/* Packet pool */
+
+/* 
+ * Packets freed by any connection are kept for the next allocation 
+ * instead of going back to the heap -- the app thread allocates what the 
+ * engine frees and the other way around, so there is one pool for the 
+ * library with its own lock (taken after any socket mutex). It gives 
+ * everything back to the heap when the last connection closes. 
+ */
+struct packet_pool{
+    pthread_mutex_t mutex; /* protects the free list and the connections' pool counters */
+    packet_t *free_list; /* free packets, linked through next */
+    int n_free; /* number of packets on the free list */
+    size_t bytes; /* bytes the free packets keep resident (their touched bytes) */
+}; 
+
+typedef struct packet_pool packet_pool_t; 
+
+packet_pool_t packet_pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }; 
+
+/* 
+ * What a free packet costs the pool 
+ */
+size_t poolCost(packet_t *packet){
+    return offsetof(packet_t, header) + packet->touched; 
+}
+
+/* 
+ * Get a packet from the pool (or the heap when the pool is empty) -- the 
+ * header and the bookkeeping fields are cleared, the payload is not 
+ * (counted as a pool hit or miss of the connection asking for it, under 
+ * the pool mutex -- the app and the engine both allocate without the 
+ * socket locked) 
+ */
+packet_t * allocPacket(socket352_t *socket){
+    pthread_mutex_lock(&packet_pool.mutex); 
+    packet_t *packet = packet_pool.free_list; 
+    if(packet != NULL){
+        packet_pool.free_list = packet->next; 
+        packet_pool.n_free--; 
+        packet_pool.bytes -= poolCost(packet); 
+        socket->pool_hits++; 
+    }
+    else socket->pool_misses++; 
+    pthread_mutex_unlock(&packet_pool.mutex); 
+
+    uint32_t touched = 0; 
+    if(packet != NULL) touched = packet->touched; 
+    else if((packet = (packet_t *)malloc(sizeof(packet_t))) == NULL){
+        printf("Failed to allocate a packet in allocPacket(): %s\n", strerror(errno)); 
+        return NULL; 
+    }
+
+    memset(packet, 0, offsetof(packet_t, data)); 
+    packet->touched = touched; 
+    return packet; 
+}
+
+/* 
+ * Give a packet back to the pool (to the heap once the pool holds 
+ * SOCK352_POOL_BYTES) 
+ */
+int freePacket(packet_t *packet){
+    if(packet == NULL) return 0; 
+
     /* 
-     * Get to the end of the list 
+     * The header says how much of the packet its last use touched 
      */
-    packet_t *ptr = socket->recv_packets; 
-    while(ptr->next != NULL) ptr = ptr->next; 
+    size_t used = packet->header.header_len + ntohs(packet->header.payload_len); 
+    if(used > MAX_UDP_PACKET_SIZE) used = MAX_UDP_PACKET_SIZE; 
+    if(used > packet->touched) packet->touched = used; 
+
+    pthread_mutex_lock(&packet_pool.mutex); 
+    if(packet_pool.bytes + poolCost(packet) <= SOCK352_POOL_BYTES){
+        packet->next = packet_pool.free_list; 
+        packet_pool.free_list = packet; 
+        packet_pool.n_free++; 
+        packet_pool.bytes += poolCost(packet); 
+        packet = NULL; 
+    }
+    pthread_mutex_unlock(&packet_pool.mutex); 
+
+    free(packet); 
+    return 0; 
+}
+
+/* 
+ * Give every free packet back to the heap (the last connection closed) 
+ */
+int trimPool(){
+    pthread_mutex_lock(&packet_pool.mutex); 
+    packet_t *packet = packet_pool.free_list; 
+    packet_pool.free_list = NULL; 
+    packet_pool.n_free = 0; 
+    packet_pool.bytes = 0; 
+    pthread_mutex_unlock(&packet_pool.mutex); 
+
+    while(packet != NULL){
+        packet_t *next = packet->next; 
+        free(packet); 
+        packet = next; 
+    }
+    return 0; 
+}
+
+/* 
+ * A connection's pool hits and misses (they are counted under the pool 
+ * mutex, not the socket's) 
+ */
+int poolStats(socket352_t *socket, sock352_stats_t *stats){
+    pthread_mutex_lock(&packet_pool.mutex); 
+    stats->pool_hits = socket->pool_hits; 
+    stats->pool_misses = socket->pool_misses; 
+    pthread_mutex_unlock(&packet_pool.mutex); 
+    return 0; 
+}
+
+/* 
+ * Bytes of a packet that go on the wire -- the header, its options and 
+ * the payload 
+ */
+size_t packetLength(packet_t *packet){
+    return packet->header.header_len + ntohs(packet->header.payload_len); 
+}
+
+/* 
+ * Fill in the checksum of a datagram of len bytes just before it goes out 
+ */
+void setChecksum(sock352_pkt_hdr_t *header, size_t len){
+    header->checksum = htons(packetChecksum(header, len)); 
+}
+
+/* 
+ * Does a datagram of len bytes hold exactly the packet its header 
+ * describes, intact? Options only come without payload (the payload 
+ * always starts right after the fixed header) 
+ */
+int checkPacket(packet_t *packet, size_t len){
+    if(len < sizeof(sock352_pkt_hdr_t)) return 0; 
+
+    size_t header_len = packet->header.header_len; 
+    if(header_len < sizeof(sock352_pkt_hdr_t) || header_len > sizeof(sock352_pkt_hdr_t) + SOCK352_MAX_SACK_BLOCKS * sizeof(sock352_sack_block_t)) return 0; 
+    if(packet->header.payload_len > 0xffff || ntohs(packet->header.payload_len) > MAX_DATA_SIZE) return 0; 
+    if(packet->header.payload_len != 0 && header_len != sizeof(sock352_pkt_hdr_t)) return 0; 
+
+    if(packetLength(packet) != len) return 0; 
+
+    return ntohs(packet->header.checksum) == packetChecksum(&packet->header, len); 
+}
 
-    ptr->next = packet; 
-    packet->prev = ptr; 
+/* 
+ * Add a packet to the tail of the send buffer 
+ */
+int addSendPacket(socket352_t *socket, packet_t *packet){
     packet->next = NULL; 
+    packet->prev = socket->send_tail; 
+
+    if(socket->send_tail != NULL) socket->send_tail->next = packet; 
+    else socket->send_queue = packet; 
+
+    socket->send_tail = packet; 
+    socket->n_queued++; 
 
     return 0; 
 }
 
 /* 
- * Initialize the mutex 
+ * Remove the packet at the head of the send buffer 
  */
-int initMutex(socket352_t *socket){
-    return pthread_mutex_init(socket->mutex, NULL);
+packet_t * popSendPacket(socket352_t *socket){
+    packet_t *packet = socket->send_queue; 
+    if(packet == NULL) return NULL; 
+
+    socket->send_queue = packet->next; 
+    if(socket->send_queue != NULL) socket->send_queue->prev = NULL; 
+    else socket->send_tail = NULL; 
+    socket->n_queued--; 
+
+    return packet; 
 }
 
 /* 
- * Lock the socket
+ * Add a packet to the tail of the transmit list 
  */
-int lockSocket(socket352_t *socket){
-    pthread_mutex_lock(socket->mutex); 
+int addTransPacket(socket352_t *socket, packet_t *packet){
+    packet->next = NULL; 
+    packet->prev = socket->unack_tail; 
+
+    if(socket->unack_tail != NULL) socket->unack_tail->next = packet; 
+    else socket->unack_packets = packet; 
+
+    socket->unack_tail = packet; 
+    socket->n_unacked++; 
+
+    return 0; 
 }
 
 /* 
- * Unlock the socket
+ * Remove packet from the transmit list 
  */
-int unlockSocket(socket352_t *socket){
-    pthread_mutex_unlock(socket->mutex); 
+int removeTransPacket(socket352_t *socket, packet_t *packet){
+    if(packet->batched) flushBatch(socket); /* still needed by sendmmsg */
+
+    if(packet->prev) packet->prev->next = packet->next; 
+    else socket->unack_packets = packet->next; 
+
+    if(packet->next) packet->next->prev = packet->prev; 
+    else socket->unack_tail = packet->prev; 
+
+    socket->n_unacked--; 
+    if(packet->sacked) socket->n_sacked--; 
+    if(packet->lost) socket->n_lost--; 
+    freePacket(packet); 
+
+    return 0; 
 }
 
 /* 
- * Get the sequence number 
+ * Is a packet with this sequence number in the receive ring? 
  */
-int getSeqNumber(socket352_t *socket){
-    return socket->seq_no++; 
+int recvPresent(socket352_t *socket, uint64_t seq){
+    if(socket->recv_ring == NULL || seq < socket->recv_head || seq - socket->recv_head >= socket->recv_size) return 0; 
+
+    uint64_t slot = seq & (socket->recv_size - 1); 
+    return (socket->recv_map[slot >> 6] >> (slot & 63)) & 1; 
 }
 
-int addClient(socket352_t *server, socket352_t *client){
-    int i=0; 
-    for(;i<server->n_connections;i++){
-        if((server->connections)[i] == 0){
-            (server->connections)[i] = client->fd; 
-            return SOCK352_SUCCESS; 
+/* 
+ * First sequence number in [seq, end) whose slot is taken (present = 1) 
+ * or free (present = 0), end if none -- a bitmap word at a time 
+ */
+uint64_t recvScan(socket352_t *socket, uint64_t seq, uint64_t end, int present){
+    while(seq < end){
+        uint64_t slot = seq & (socket->recv_size - 1); 
+        uint64_t word = socket->recv_map[slot >> 6]; 
+        if(!present) word = ~word; 
+        word >>= (slot & 63); 
+
+        if(word != 0){
+            seq += __builtin_ctzll(word); 
+            break; 
         }
+        seq += 64 - (slot & 63); 
+    }
+
+    return (seq < end) ? seq : end; 
+}
+
+/* 
+ * Make the ring big enough for a sequence number 
+ * returns -1 if that takes more than SOCK352_RECV_RING_MAX slots
+ */
+int growRecvRing(socket352_t *socket, uint64_t seq){
+    if(seq - socket->recv_head >= SOCK352_RECV_RING_MAX) return -1; /* also keeps size from wrapping */
+
+    uint64_t size = (socket->recv_size != 0) ? socket->recv_size : SOCK352_RECV_RING_MIN; 
+    while(seq - socket->recv_head >= size && size < SOCK352_RECV_RING_MAX) size *= 2; 
+    if(size == socket->recv_size) return 0; 
+
+    packet_t **ring = (packet_t **)calloc(size, sizeof(packet_t *)); 
+    uint64_t *map = (uint64_t *)calloc(size / 64, sizeof(uint64_t)); 
+
+    /* 
+     * Move the packets to their slots in the bigger ring 
+     */
+    uint64_t i=0; 
+    for(;i<socket->recv_size;i++){
+        if(!((socket->recv_map[i >> 6] >> (i & 63)) & 1)) continue; 
+
+        uint64_t slot = socket->recv_ring[i]->header.sequence_no & (size - 1); 
+        ring[slot] = socket->recv_ring[i]; 
+        map[slot >> 6] |= 1ULL << (slot & 63); 
+    }
+
+    free(socket->recv_ring); 
+    free(socket->recv_map); 
+    socket->recv_ring = ring; 
+    socket->recv_map = map; 
+    socket->recv_size = size; 
+
+    return 0; 
+}
+
+/* 
+ * Put a packet in its slot of the receive ring 
+ * returns -1 if the packet is already there or too far ahead to hold
+ */
+int addRecvPacket(socket352_t *socket, packet_t *packet){
+    uint64_t seq = packet->header.sequence_no; 
+
+    if(socket->recv_ring == NULL){
+        socket->recv_head = socket->recv_high = socket->recv_next; 
     }
-    return SOCK352_FAILURE; 
+    if(seq < socket->recv_head) return -1; 
+    if((socket->recv_ring == NULL || seq - socket->recv_head >= socket->recv_size) && growRecvRing(socket, seq) < 0) return -1; 
+    if(recvPresent(socket, seq)) return -1; 
+
+    uint64_t slot = seq & (socket->recv_size - 1); 
+    socket->recv_ring[slot] = packet; 
+    socket->recv_map[slot >> 6] |= 1ULL << (slot & 63); 
+    if(seq >= socket->recv_high) socket->recv_high = seq + 1; 
+
+    return 0; 
+}
+
+/* 
+ * Take the packet with a sequence number out of the ring (doesn't free it) 
+ */
+packet_t * removeRecvPacket(socket352_t *socket, uint64_t seq){
+    if(!recvPresent(socket, seq)) return NULL; 
+
+    uint64_t slot = seq & (socket->recv_size - 1); 
+    socket->recv_map[slot >> 6] &= ~(1ULL << (slot & 63)); 
+    return socket->recv_ring[slot]; 
+}
+
+/* 
+ * Is the oldest unread packet in order (ready for the app)? 
+ */
+int hasInOrderPacket(socket352_t *socket){
+    return socket->recv_head < socket->recv_next && recvPresent(socket, socket->recv_head); 
+}
+
+/* 
+ * The oldest unread packet if it is in order, NULL otherwise 
+ */
+packet_t * peekRecvPacket(socket352_t *socket){
+    if(!hasInOrderPacket(socket)) return NULL; 
+    return socket->recv_ring[socket->recv_head & (socket->recv_size - 1)]; 
+}
+
+/* 
+ * Take the oldest unread packet if it is in order 
+ */
+packet_t * popRecvPacket(socket352_t *socket){
+    if(!hasInOrderPacket(socket)) return NULL; 
+
+    packet_t *packet = removeRecvPacket(socket, socket->recv_head); 
+    socket->recv_head++; 
+    return packet; 
+}
+
+/* 
+ * Free the receive ring and every packet in it 
+ */
+int freeRecvRing(socket352_t *socket){
+    uint64_t i=0; 
+    for(;i<socket->recv_size;i++){
+        if((socket->recv_map[i >> 6] >> (i & 63)) & 1) freePacket(socket->recv_ring[i]); 
+    }
+
+    free(socket->recv_ring); 
+    free(socket->recv_map); 
+    socket->recv_ring = NULL; 
+    socket->recv_map = NULL; 
+    socket->recv_size = 0; 
+    return 0; 
+}
+
+/* 
+ * Free a socket that never reached the app (the engine and the hash 
+ * table don't know it) 
+ */
+int freeSocket(socket352_t *socket){
+    pthread_mutex_destroy(socket->mutex); 
+    pthread_cond_destroy(socket->cond); 
+    free(socket->mutex); 
+    free(socket->cond); 
+    free(socket->other); 
+    freeRecvRing(socket); 
+
+    free(socket); 
+    return 0; 
+}
+
+/* 
+ * What the app can do without blocking (SOCK352_EPOLL* events) 
+ */
+uint32_t socketReadiness(socket352_t *socket){
+    if(socket->state == LISTEN) return (socket->accept_queue != NULL) ? SOCK352_EPOLLIN : 0; 
+    if(socket->error) return SOCK352_EPOLLIN | SOCK352_EPOLLOUT | SOCK352_EPOLLERR; 
+
+    uint32_t events = 0; 
+    if(hasInOrderPacket(socket) || socket->peer_fin) events |= SOCK352_EPOLLIN; 
+    if((socket->state == ESTABLISHED || socket->state == SYN_RECEIVED) && socket->n_queued < socket->window) events |= SOCK352_EPOLLOUT; 
+
+    return events; 
+}
+
+/* 
+ * Get the sequence number 
+ */
+uint64_t getSeqNumber(socket352_t *socket){
+    return socket->seq_no++; 
+}
+
+/* 
+ * Get the current (monotonic) time in micro-seconds 
+ */
+uint64_t nowUsec(){
+    struct timespec ts; 
+    clock_gettime(CLOCK_MONOTONIC, &ts); 
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000; 
+}
+
+/* 
+ * Fold a round trip time sample into the estimate and recompute the RTO 
+ * (RFC 6298)
+ */
+int updateRtt(socket352_t *socket, uint64_t sample){
+    if(socket->srtt == 0){
+        socket->srtt = sample; 
+        socket->rttvar = sample / 2; 
+    }
+    else{
+        uint64_t delta = (socket->srtt > sample) ? socket->srtt - sample : sample - socket->srtt; 
+        socket->rttvar = (3 * socket->rttvar + delta) / 4; 
+        socket->srtt = (7 * socket->srtt + sample) / 8; 
+    }
+
+    socket->rto = socket->srtt + 4 * socket->rttvar; 
+    if(socket->rto < SOCK352_MIN_RTO) socket->rto = SOCK352_MIN_RTO; 
+    if(socket->rto > SOCK352_MAX_RTO) socket->rto = SOCK352_MAX_RTO; 
+
+    return 0; 
+}
+
+/* 
+ * Get the retransmission timeout with exponential backoff applied 
+ */
+uint64_t currentRto(socket352_t *socket){
+    uint64_t rto = socket->rto; 
+    int i=0; 
+    for(;i<socket->backoffs && rto < SOCK352_MAX_RTO;i++) rto *= 2; 
+
+    return (rto < SOCK352_MAX_RTO) ? rto : SOCK352_MAX_RTO; 
+}
+
+/* 
+ * Number of packets still in the network -- SACKed and lost packets 
+ * have left it 
+ */
+int packetsInFlight(socket352_t *socket){
+    return socket->n_unacked - socket->n_sacked - socket->n_lost; 
+}
+
+/* 
+ * Can another new packet be sent? (only a few before the client of a 
+ * fast open connection proved its address with an ACK) 
+ */
+int windowOpen(socket352_t *socket){
+    if(socket->n_unacked >= socket->window) return 0; 
+    if(socket->state == SYN_RECEIVED && socket->n_unacked >= SOCK352_SYN_DATA_PACKETS) return 0; 
+
+    return packetsInFlight(socket) < (int)socket->cc.cwnd; 
+}
+
+/* 
+ * Time between two packets at the pacing rate (usec), 0 if not pacing 
+ */
+uint64_t pacingInterval(socket352_t *socket){
+    if(!socket->pacing || socket->srtt == 0) return 0; 
+
+    int gain = (socket->cc.cwnd < socket->cc.ssthresh) ? SOCK352_PACING_SS_GAIN : SOCK352_PACING_CA_GAIN; 
+
+    return (uint64_t)(socket->srtt * 100 / (gain * socket->cc.cwnd)); 
+}
+
+/* 
+ * The pacing rate in bytes/sec 
+ */
+uint64_t pacingRate(socket352_t *socket){
+    uint64_t interval = pacingInterval(socket); 
+    if(interval == 0) return 0; 
+
+    return (uint64_t)(sizeof(sock352_pkt_hdr_t) + socket->mss) * 1000000 / interval; 
+}
+
+/* 
+ * Has the pacing timer let the next packet out? 
+ */
+int paceOpen(socket352_t *socket){
+    if(!socket->pacing || socket->pace_next <= nowUsec()) return 1; 
+
+    socket->stats.pacing_waits++; 
+    return 0; 
+}
+
+/* 
+ * A packet went out -- push the pacing timer back by one interval, and 
+ * hand the rate to the kernel (it paces too, with the fq qdisc) when it 
+ * moved by more than a quarter 
+ */
+int pacePacket(socket352_t *socket, uint64_t now){
+    if(!socket->pacing) return 0; 
+
+    if(socket->pace_next < now) socket->pace_next = now; /* no credit for idle time */
+    socket->pace_next += pacingInterval(socket); 
+
+#ifdef SO_MAX_PACING_RATE
+    uint64_t rate = pacingRate(socket); 
+    uint64_t last = socket->kernel_pacing_rate; 
+    if(rate > 0 && (rate > last + last / 4 || rate < last - last / 4)){
+        unsigned int kernel_rate = (rate < 0xffffffff) ? (unsigned int)rate : 0xffffffff; 
+        setsockopt(socket->sock_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &kernel_rate, sizeof(kernel_rate)); 
+        socket->kernel_pacing_rate = rate; 
+    }
+#endif
+
+    return 0; 
+}
+
+/* 
+ * A packet was found lost -- tell congestion control once per window of 
+ * data (the loss event ends when everything sent before it is ACKed)
+ */
+int congestionEvent(socket352_t *socket, packet_t *packet, int timeout){
+    if(timeout){
+        socket->cc.algorithm->on_rto(&socket->cc); 
+    }
+    else{
+        if(packet->header.sequence_no < socket->recovery_point) return 0; 
+        socket->cc.algorithm->on_loss(&socket->cc, nowUsec()); 
+    }
+
+    socket->stats.loss_events++; 
+    socket->recovery_point = socket->seq_no; 
+    socket->rto_recovery = timeout; 
+
+    return 0; 
+}
+
+/* Path MTU discovery */
+
+/* 
+ * Datagram sizes probed, smallest first -- Ethernet, jumbo Ethernet and 
+ * the largest UDP packet (loopback and other large-MTU links) 
+ */
+const int mtu_probe_sizes[] = { 1472, 8972, MAX_UDP_PACKET_SIZE }; 
+
+#define SOCK352_PROBE_SIZES (int)(sizeof(mtu_probe_sizes) / sizeof(mtu_probe_sizes[0]))
+
+/* 
+ * A connection was established -- start probing for a larger MSS unless 
+ * the app fixed it 
+ */
+int startProbing(socket352_t *socket){
+    if(socket->mss_option != 0){
+        socket->probe_index = -1; 
+        return 0; 
+    }
+
+    /* 
+     * DF on and the kernel's path MTU ignored -- a probe too big for the 
+     * path is dropped instead of fragmented 
+     */
+    int mode = IP_PMTUDISC_PROBE; 
+    if(setsockopt(socket->sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0){
+        printf("Failed to set IP_MTU_DISCOVER in startProbing(): %s\n", strerror(errno)); 
+        socket->probe_index = -1; 
+        return SOCK352_FAILURE; 
+    }
+
+    socket->probe_index = 0; 
+    socket->probe_deadline = nowUsec(); 
+    return 0; 
+}
+
+/* 
+ * Stop probing -- the MSS stays where the last answered probe put it 
+ */
+int stopProbing(socket352_t *socket){
+    socket->probe_index = -1; 
+    socket->probe_size = 0; 
+    socket->probe_deadline = 0; 
+    return 0; 
+}
+
+/* 
+ * The probe timer fired -- resend the outstanding probe, give its size up 
+ * after SOCK352_MAX_PROBES, or probe the next size 
+ * probes are sent right away (not batched) so a size the local link 
+ * can't take shows up as EMSGSIZE 
+ */
+int probeMtu(socket352_t *socket){
+    socket->probe_deadline = 0; 
+    if(socket->probe_index < 0) return 0; 
+
+    /* 
+     * No padded probes to a fast open client before its ACK proves its 
+     * address -- try again a round trip later 
+     */
+    if(socket->state == SYN_RECEIVED){
+        socket->probe_deadline = nowUsec() + currentRto(socket); 
+        return 0; 
+    }
+
+    if(socket->probe_size != 0 && socket->probe_count >= SOCK352_MAX_PROBES) return stopProbing(socket); 
+
+    if(socket->probe_size == 0){
+        while(socket->probe_index < SOCK352_PROBE_SIZES && mtu_probe_sizes[socket->probe_index] - (int)sizeof(sock352_pkt_hdr_t) <= socket->mss) socket->probe_index++; 
+        if(socket->probe_index == SOCK352_PROBE_SIZES) return stopProbing(socket); 
+
+        socket->probe_size = mtu_probe_sizes[socket->probe_index]; 
+        socket->probe_count = 0; 
+    }
+
+    /* 
+     * The padding is zeroed once, never anything left over from a payload 
+     */
+    if(socket->probe_packet == NULL){
+        if((socket->probe_packet = allocPacket(socket)) == NULL) return SOCK352_FAILURE; 
+        memset(socket->probe_packet->data, 0, MAX_DATA_SIZE); 
+        socket->probe_packet->touched = MAX_UDP_PACKET_SIZE; 
+    }
+    packet_t *probe = socket->probe_packet; 
+    memset(&probe->header, 0, sizeof(sock352_pkt_hdr_t)); 
+    probe->header.version = SOCK352_VER_1; 
+    probe->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
+    probe->header.flags = SOCK352_PROBE; 
+    probe->header.sequence_no = socket->seq_no; /* probes don't use up a sequence number */
+    probe->header.payload_len = htons(socket->probe_size - sizeof(sock352_pkt_hdr_t)); 
+
+    socket->probe_count++; 
+    socket->stats.mtu_probes++; 
+    setChecksum(&probe->header, socket->probe_size); 
+    if(sendto(socket->sock_fd, &probe->header, socket->probe_size, 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in)) < 0){
+        if(errno == EMSGSIZE) return stopProbing(socket); 
+        printf("Failed to send an MTU probe in probeMtu(): %s\n", strerror(errno)); 
+    }
+
+    socket->probe_deadline = nowUsec() + currentRto(socket); 
+    return 0; 
+}
+
+/* 
+ * A probe or the answer to one arrived -- answer a probe with its size 
+ * (in ack_no, only the header goes back), take the size of an answer to 
+ * our outstanding probe as the new MSS and go on with the next size 
+ */
+int handleProbe(socket352_t *socket, packet_t *packet){
+    if(!(packet->header.flags & SOCK352_ACK)){
+        sock352_pkt_hdr_t header; 
+        memset(&header, 0, sizeof(header)); 
+        header.version = SOCK352_VER_1; 
+        header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
+        header.flags = SOCK352_PROBE | SOCK352_ACK; 
+        header.sequence_no = socket->seq_no; 
+        header.ack_no = packetLength(packet); 
+        setChecksum(&header, sizeof(header)); 
+
+        if(sendto(socket->sock_fd, &header, sizeof(header), 0, (struct sockaddr *)socket->other, sizeof(struct sockaddr_in)) < 0){
+            printf("Failed to answer an MTU probe in handleProbe(): %s\n", strerror(errno)); 
+        }
+        return 0; 
+    }
+
+    if(socket->probe_size == 0 || packet->header.ack_no != (uint64_t)socket->probe_size) return 0; 
+
+    socket->mss = socket->probe_size - sizeof(sock352_pkt_hdr_t); 
+    socket->probe_size = 0; 
+    socket->probe_index++; 
+    socket->probe_deadline = nowUsec(); 
+    return 0; 
+}
+
+
+/* Connection demultiplexing (server side) */
+
+/* 
+ * Build the demux key of a client 
+ */
+demux_key_t demuxKey(struct sockaddr_in *from, uint32_t cs352_port){
+    demux_key_t key; 
+    memset(&key, 0, sizeof(key)); 
+    key.addr = from->sin_addr.s_addr; 
+    key.port = from->sin_port; 
+    key.cs352_port = cs352_port; 
+    return key; 
+}
+
+/* 
+ * Add a connection to its listener's demux table 
+ * called with the listener locked
+ */
+int addDemux(socket352_t *listener, socket352_t *client, demux_key_t key){
+    client->listener = listener; 
+    client->demux_key = key; 
+    HASH_ADD(demux_hh, listener->demux, demux_key, sizeof(demux_key_t), client); 
+    return SOCK352_SUCCESS; 
+}
+
+/* 
+ * Take a connection out of its listener's demux table -- once this returns 
+ * the engine no longer routes packets to it 
+ * returns 1 if it was the last connection of a closed listener (the caller 
+ * then closes their UDP socket), 0 otherwise 
+ */
+int removeDemux(socket352_t *client){
+    socket352_t *listener = client->listener; 
+
+    lockSocket(listener); 
+    HASH_DELETE(demux_hh, listener->demux, client); 
+    int last = (listener->state == CLOSED && listener->demux == NULL); 
+    unlockSocket(listener); 
+
+    return last; 
+}
+
+/* 
+ * Find the connection a packet belongs to, NULL if it is from a new client 
+ * called with the listener locked
+ */
+socket352_t * findDemux(socket352_t *listener, struct sockaddr_in *from, uint32_t cs352_port){
+    demux_key_t key = demuxKey(from, cs352_port); 
+    socket352_t *client = NULL; 
+
+    HASH_FIND(demux_hh, listener->demux, &key, sizeof(demux_key_t), client); 
+
+    return client; 
+}
+
+/* 
+ * Add a connection to the tail of the listener's accept queue 
+ */
+int queueSocket(socket352_t **head, socket352_t **tail, socket352_t *socket){
+    socket->queue_next = NULL; 
+    socket->queue_prev = *tail; 
+    if(*tail != NULL) (*tail)->queue_next = socket; 
+    else *head = socket; 
+    *tail = socket; 
+    return 0; 
+}
+
+/* 
+ * Take a connection out of the listener's accept queue 
+ */
+int unqueueSocket(socket352_t **head, socket352_t **tail, socket352_t *socket){
+    if(socket->queue_prev != NULL) socket->queue_prev->queue_next = socket->queue_next; 
+    else *head = socket->queue_next; 
+    if(socket->queue_next != NULL) socket->queue_next->queue_prev = socket->queue_prev; 
+    else *tail = socket->queue_prev; 
+    socket->queue_next = socket->queue_prev = NULL; 
+    return 0; 
+}
+
+/* 
+ * Is the connection (still) in the listener's accept queue? 
+ */
+int isQueued(socket352_t *listener, socket352_t *socket){
+    return socket->queue_prev != NULL || listener->accept_queue == socket; 
+}
+
+/* 
+ * Add a half-open connection to the tail of the listener's half-open list 
+ * (a fast open one is in the accept queue as well and counts there) 
+ */
+int addPending(socket352_t *listener, socket352_t *client){
+    client->pending_next = NULL; 
+    client->pending_prev = listener->pending_tail; 
+    if(listener->pending_tail != NULL) listener->pending_tail->pending_next = client; 
+    else listener->pending = client; 
+    listener->pending_tail = client; 
+    if(!client->fast_open) listener->n_pending++; 
+    return 0; 
+}
+
+/* 
+ * Take a connection out of the listener's half-open list 
+ */
+int removePending(socket352_t *listener, socket352_t *client){
+    if(client->pending_prev != NULL) client->pending_prev->pending_next = client->pending_next; 
+    else listener->pending = client->pending_next; 
+    if(client->pending_next != NULL) client->pending_next->pending_prev = client->pending_prev; 
+    else listener->pending_tail = client->pending_prev; 
+    client->pending_next = client->pending_prev = NULL; 
+    if(!client->fast_open) listener->n_pending--; 
+    return 0; 
+}
+
+/* 
+ * Create a connection for a new client of a listener and route the 
+ * client's packets to it 
+ * called by the engine with the listener locked
+ */
+socket352_t * newConnection(socket352_t *listener, struct sockaddr_in *from, uint32_t cs352_port, uint64_t client_seq){
+    socket352_t *client = newSocket(listener); 
+    client->sock_fd = listener->sock_fd; 
+    client->other = (struct sockaddr_in *)calloc(1, sizeof(struct sockaddr_in)); 
+    *client->other = *from; 
+    client->state = SYN_RECEIVED; 
+
+    /* 
+     * The client's data starts right after its SYN 
+     */
+    client->recv_next = client_seq + 1; 
+
+    addDemux(listener, client, demuxKey(from, cs352_port)); 
+    return client; 
+}
+
+uint64_t fastOpenCookie(socket352_t *listener, struct sockaddr_in *from); 
+
+/* 
+ * Answer a SYN (the header and the client's fast open cookie) -- ack_no 
+ * says whether the data in the SYN was taken (SYN sequence number + 2) 
+ * or has to be sent again (+ 1) 
+ */
+int sendSynAck(socket352_t *listener, packet_t *packet, struct sockaddr_in *from, uint64_t seq, uint64_t ack_no){
+    char datagram[sizeof(sock352_pkt_hdr_t) + sizeof(uint64_t)]; 
+    sock352_pkt_hdr_t *header = (sock352_pkt_hdr_t *)datagram; 
+    *header = packet->header; 
+    header->flags = SOCK352_SYN | SOCK352_ACK | SOCK352_HAS_OPT; 
+    header->opt_ptr = SOCK352_OPT_TYPE_FASTOPEN; 
+    header->ack_no = ack_no; 
+    header->sequence_no = seq; 
+    header->window = sizeof(packet->data); 
+    header->header_len = (uint16_t)sizeof(datagram); 
+    header->payload_len = 0; 
+
+    uint64_t cookie = fastOpenCookie(listener, from); 
+    memcpy(datagram + sizeof(sock352_pkt_hdr_t), &cookie, sizeof(cookie)); 
+    setChecksum(header, sizeof(datagram)); 
+
+    if(sendto(listener->sock_fd, datagram, sizeof(datagram), 0, (struct sockaddr *)from, sizeof(struct sockaddr_in)) < 0){
+        printf("Failed to send SYN|ACK packet in sendSynAck(): %s\n", strerror(errno)); 
+        return SOCK352_FAILURE; 
+    }
+    return SOCK352_SUCCESS; 
+}
+
+/* SYN cookies */
+
+/* 
+ * Pick a new key for the listener's cookies
+ */
+int initCookies(socket352_t *listener){
+    if(getrandom(listener->cookie_secret, sizeof(listener->cookie_secret), 0) != sizeof(listener->cookie_secret)){
+        listener->cookie_secret[0] = nowUsec() ^ ((uint64_t)getpid() << 32); 
+        listener->cookie_secret[1] = (uint64_t)(uintptr_t)listener ^ nowUsec(); 
+    }
+    return 0; 
+}
+
+/* 
+ * Mix the bits of a word (the splitmix64 finalizer) 
+ */
+uint64_t mix64(uint64_t x){
+    x ^= x >> 30; 
+    x *= 0xbf58476d1ce4e5b9ULL; 
+    x ^= x >> 27; 
+    x *= 0x94d049bb133111ebULL; 
+    x ^= x >> 31; 
+    return x; 
+}
+
+/* 
+ * The cookie of a client's SYN in a time slot 
+ */
+uint64_t makeCookie(socket352_t *listener, struct sockaddr_in *from, uint32_t cs352_port, uint64_t client_seq, uint64_t slot){
+    uint64_t words[4]; 
+    words[0] = ((uint64_t)from->sin_addr.s_addr << 16) | from->sin_port; 
+    words[1] = cs352_port; 
+    words[2] = client_seq; 
+    words[3] = slot; 
+
+    uint64_t hash = listener->cookie_secret[0]; 
+    int i=0; 
+    for(;i<4;i++) hash = mix64(hash ^ words[i]) + listener->cookie_secret[1]; 
+
+    slot &= 0xff; 
+    return (slot << SOCK352_COOKIE_HASH_BITS) | (hash & ((1ULL << SOCK352_COOKIE_HASH_BITS) - 1)); 
+}
+
+/* 
+ * Answer a SYN with a cookie -- nothing is kept until the client proves 
+ * it got the SYN|ACK 
+ */
+int sendCookie(socket352_t *listener, packet_t *packet, struct sockaddr_in *from){
+    uint64_t slot = nowUsec() / SOCK352_COOKIE_SLOT; 
+    uint64_t cookie = makeCookie(listener, from, packet->header.source_port, packet->header.sequence_no, slot); 
+
+    listener->stats.syn_cookies++; 
+    return sendSynAck(listener, packet, from, cookie, packet->header.sequence_no + 1); 
+}
+
+/* 
+ * A packet from an unknown client that ACKs our SYN|ACK -- if it carries a 
+ * cookie from this or the last slot, create the connection it stands for 
+ * (the client's SYN took the sequence number before the one the packet 
+ * carries, its ACK or first data) 
+ * returns the connection in SYN_RECEIVED, NULL to drop the packet
+ */
+socket352_t * checkCookie(socket352_t *listener, packet_t *packet, struct sockaddr_in *from){
+    uint64_t cookie = packet->header.ack_no - 1; 
+    uint64_t client_seq = packet->header.sequence_no - 1; 
+    uint64_t slot = nowUsec() / SOCK352_COOKIE_SLOT; 
+
+    if(cookie != makeCookie(listener, from, packet->header.source_port, client_seq, slot) && 
+       (slot == 0 || cookie != makeCookie(listener, from, packet->header.source_port, client_seq, slot - 1))){
+        listener->stats.bad_cookies++; 
+        return NULL; 
+    }
+
+    /* 
+     * No room in the accept queue -- the client finds out when its data 
+     * goes unanswered (half-open connections don't count, the client 
+     * proved itself and they may all be spoofed) 
+     */
+    if(listener->n_accept >= listener->n_connections){
+        listener->stats.syn_drops++; 
+        return NULL; 
+    }
+
+    socket352_t *client = newConnection(listener, from, packet->header.source_port, client_seq); 
+    client->seq_no = cookie + 1; 
+    return client; 
+}
+
+/* Fast open cookies */
+
+/* 
+ * A cookie the client got from a server 
+ */
+struct fast_open_cookie{
+    struct sockaddr_in server; /* the server's UDP address */
+    uint64_t cookie; /* 0 for a free entry */
+}; 
+
+typedef struct fast_open_cookie fast_open_cookie_t; 
+
+fast_open_cookie_t fast_open_cache[SOCK352_FASTOPEN_CACHE]; /* the cookies of the last few servers */
+int fast_open_next = 0; /* entry the next new server replaces */
+pthread_mutex_t fast_open_mutex = PTHREAD_MUTEX_INITIALIZER; /* protects the cache */
+
+/* 
+ * The fast open cookie of a client -- a keyed hash of its address, the 
+ * client shows it received a SYN|ACK there before (never 0) 
+ */
+uint64_t fastOpenCookie(socket352_t *listener, struct sockaddr_in *from){
+    return mix64(mix64(listener->cookie_secret[1] ^ from->sin_addr.s_addr) + listener->cookie_secret[0]) | 1; 
+}
+
+/* 
+ * The cached cookie of a server, 0 if we have none 
+ */
+uint64_t findFastOpenCookie(struct sockaddr_in *server){
+    uint64_t cookie = 0; 
+
+    pthread_mutex_lock(&fast_open_mutex); 
+    int i=0; 
+    for(;i<SOCK352_FASTOPEN_CACHE;i++){
+        fast_open_cookie_t *entry = &fast_open_cache[i]; 
+        if(entry->cookie != 0 && entry->server.sin_addr.s_addr == server->sin_addr.s_addr && entry->server.sin_port == server->sin_port){
+            cookie = entry->cookie; 
+            break; 
+        }
+    }
+    pthread_mutex_unlock(&fast_open_mutex); 
+
+    return cookie; 
+}
+
+/* 
+ * Keep the cookie from a server's SYN|ACK (replacing the one we had) 
+ */
+int saveFastOpenCookie(struct sockaddr_in *server, packet_t *packet){
+    if(!(packet->header.flags & SOCK352_HAS_OPT) || packet->header.opt_ptr != SOCK352_OPT_TYPE_FASTOPEN) return 0; 
+    if(packet->header.header_len < sizeof(sock352_pkt_hdr_t) + sizeof(uint64_t)) return 0; 
+
+    uint64_t cookie; 
+    memcpy(&cookie, packet->data, sizeof(cookie)); 
+
+    pthread_mutex_lock(&fast_open_mutex); 
+    fast_open_cookie_t *entry = NULL; 
+    int i=0; 
+    for(;i<SOCK352_FASTOPEN_CACHE && entry == NULL;i++){
+        if(fast_open_cache[i].server.sin_addr.s_addr == server->sin_addr.s_addr && fast_open_cache[i].server.sin_port == server->sin_port){
+            entry = &fast_open_cache[i]; 
+        }
+    }
+    if(entry == NULL){
+        entry = &fast_open_cache[fast_open_next]; 
+        fast_open_next = (fast_open_next + 1) % SOCK352_FASTOPEN_CACHE; 
+    }
+    entry->server = *server; 
+    entry->cookie = cookie; 
+    pthread_mutex_unlock(&fast_open_mutex); 
+
+    return 0; 
+}
+
+int handleData(socket352_t *socket, packet_t *packet); 
+int freeBatch(socket352_t *socket); 
+
+/* 
+ * Data in a client's SYN with a valid fast open cookie (the data comes 
+ * right after the SYN's sequence number) -- buffer it for the app and 
+ * queue the connection for accept right away, so the app can answer 
+ * before the handshake finishes (with at most SOCK352_SYN_DATA_PACKETS 
+ * packets, the connection stays on the half-open list until the ACK) 
+ */
+int fastOpen(socket352_t *listener, socket352_t *client, packet_t *packet){
+    packet_t *data = allocPacket(listener); 
+    if(data == NULL) return SOCK352_FAILURE; 
+    memcpy(&data->header, &packet->header, packetLength(packet)); 
+    data->header.flags = 0; 
+    data->header.sequence_no = packet->header.sequence_no + 1; 
+
+    /* 
+     * The SYN|ACK ACKs it 
+     */
+    if(handleData(client, data) == 0) freePacket(data); 
+    client->ack_pending = client->ack_now = client->rx_unacked = 0; 
+    client->ack_deadline = 0; 
+
+    client->fast_open = 1; 
+    queueSocket(&listener->accept_queue, &listener->accept_tail, client); 
+    listener->n_accept++; 
+    listener->stats.fast_opens++; 
+    return 0; 
+}
+
+/* 
+ * A SYN from a new client -- create the half-open connection, route the 
+ * client's packets to it and answer with a SYN|ACK, or answer with a 
+ * cookie if the listener uses them (any data in the SYN is then dropped, 
+ * the client sends it again once connected -- as it is without a valid 
+ * fast open cookie in the SYN's ack_no) 
+ * called by the engine with the listener locked
+ */
+int startHandshake(socket352_t *listener, packet_t *packet, struct sockaddr_in *from){
+    int full = (listener->n_pending + listener->n_accept >= listener->n_connections); 
+
+    if(listener->syn_cookies == 2 || (listener->syn_cookies == 1 && full)) return sendCookie(listener, packet, from); 
+
+    /* 
+     * Over the listen backlog -- the client never hears back 
+     */
+    if(full){
+        listener->stats.syn_drops++; 
+        return 0; 
+    }
+
+    socket352_t *client = newConnection(listener, from, packet->header.source_port, packet->header.sequence_no); 
+    if(ntohs(packet->header.payload_len) != 0){
+        if(packet->header.ack_no == fastOpenCookie(listener, from)) fastOpen(listener, client, packet); 
+        else listener->stats.bad_fast_opens++; 
+    }
+    addPending(listener, client); 
+
+    client->syn_usec = nowUsec(); 
+    client->syn_seq = getSeqNumber(client); 
+    sendSynAck(listener, packet, from, client->syn_seq, client->recv_next); 
+
+    return 0; 
+}
+
+/* 
+ * The client answered our SYN|ACK -- the connection moves to the accept 
+ * queue 
+ * called by the engine with the listener and the connection locked
+ */
+int finishHandshake(socket352_t *listener, socket352_t *client){
+    /* 
+     * The handshake gives us the first round trip time sample (a connection 
+     * made from a cookie was never half-open and has no send time, and 
+     * after a resent SYN|ACK we can't tell which one was answered) 
+     */
+    if(client->syn_usec != 0 && client->backoffs == 0) updateRtt(client, nowUsec() - client->syn_usec); 
+    client->backoffs = 0; 
+
+    if(client->syn_usec != 0) removePending(listener, client); 
+
+    /* 
+     * A connection that came with data in its SYN is already queued 
+     */
+    if(client->fast_open) return 0; 
+
+    queueSocket(&listener->accept_queue, &listener->accept_tail, client); 
+    listener->n_accept++; 
+    listener->stats.handshakes++; 
+
+    return 0; 
+}
+
+/* 
+ * Drop the half-open connections whose client never answered -- a fast 
+ * open one leaves the accept queue with them, or fails if the app already 
+ * accepted it 
+ * called by the engine with the listener locked
+ */
+int expireHandshakes(socket352_t *listener){
+    uint64_t now = nowUsec(); 
+
+    while(listener->pending != NULL && listener->pending->syn_usec + SOCK352_SYN_TIMEOUT <= now){
+        socket352_t *client = listener->pending; 
+        removePending(listener, client); 
+        listener->stats.syn_timeouts++; 
+
+        if(client->fast_open){
+            if(!isQueued(listener, client)){
+                lockSocket(client); 
+                client->error = 1; 
+                signalSocket(client); 
+                unlockSocket(client); 
+                continue; 
+            }
+            unqueueSocket(&listener->accept_queue, &listener->accept_tail, client); 
+            listener->n_accept--; 
+            freeBatch(client); 
+        }
+        HASH_DELETE(demux_hh, listener->demux, client); 
+        freeSocket(client); 
+    }
+
+    return 0; 
+}
+
+/* Batched datagram I/O */
+
+/* 
+ * Send the send batch as UDP GSO super-buffers -- consecutive packets are 
+ * copied into one buffer and the kernel cuts it back into datagrams 
+ * returns the number of packets sent, -1 on error 
+ * turns GSO off when the kernel or the route can't do it, the caller 
+ * sends the rest datagram by datagram
+ */
+int sendGso(socket352_t *socket){
+    int sent = 0; 
+
+    if(socket->gso_buffer == NULL) socket->gso_buffer = (char *)malloc(SOCK352_GSO_BUFFER); 
+
+    /* 
+     * A lone packet gains nothing from GSO -- and the kernel cuts the 
+     * buffer into equal segments, so a run is packets of one length, 
+     * only the last may be shorter 
+     */
+    while(socket->n_tx - sent > 1){
+        size_t segment = packetLength(socket->tx_batch[sent]); 
+        size_t total = 0; 
+        int n = 0; 
+        while(sent + n < socket->n_tx && total + segment <= SOCK352_GSO_BUFFER){
+            size_t len = packetLength(socket->tx_batch[sent + n]); 
+            if(len > segment) break; 
+
+            memcpy(socket->gso_buffer + total, &socket->tx_batch[sent + n]->header, len); 
+            total += len; 
+            n++; 
+            if(len < segment) break; 
+        }
+        if(n < 2) break; 
+
+        struct iovec iov; 
+        iov.iov_base = socket->gso_buffer; 
+        iov.iov_len = total; 
+
+        char control[CMSG_SPACE(sizeof(uint16_t))]; 
+        struct msghdr msg; 
+        memset(&msg, 0, sizeof(msg)); 
+        memset(control, 0, sizeof(control)); 
+        msg.msg_name = socket->other; 
+        msg.msg_namelen = sizeof(struct sockaddr_in); 
+        msg.msg_iov = &iov; 
+        msg.msg_iovlen = 1; 
+        msg.msg_control = control; 
+        msg.msg_controllen = sizeof(control); 
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); 
+        cmsg->cmsg_level = SOL_UDP; 
+        cmsg->cmsg_type = UDP_SEGMENT; 
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t)); 
+        *(uint16_t *)CMSG_DATA(cmsg) = segment; 
+
+        if(sendmsg(socket->sock_fd, &msg, 0) < 0){
+            if(errno == EINTR) continue; 
+            if(errno == EINVAL || errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP){
+                printf("UDP GSO not available in sendGso(): %s -- falling back to sendmmsg\n", strerror(errno)); 
+                socket->gso = 0; 
+                break; 
+            }
+            printf("Failed to send packets in sendGso(): %s\n", strerror(errno)); 
+            return SOCK352_FAILURE; 
+        }
+        socket->stats.gso_sends++; 
+        socket->stats.gso_packets += n; 
+        sent += n; 
+    }
+
+    return sent; 
+}
+
+/* 
+ * Send every packet in the send batch -- as GSO super-buffers when that is 
+ * on, the rest with sendmmsg 
+ */
+int flushBatch(socket352_t *socket){
+    struct mmsghdr msgs[SOCK352_BATCH_SIZE]; 
+    struct iovec iovs[SOCK352_BATCH_SIZE]; 
+    int rc = SOCK352_SUCCESS; 
+    int sent = 0; 
+
+    if(socket->n_tx == 0) return rc; 
+
+    /* 
+     * The headers are final now 
+     */
+    int i=0; 
+    for(;i<socket->n_tx;i++) setChecksum(&socket->tx_batch[i]->header, packetLength(socket->tx_batch[i])); 
+
+    if(socket->gso && (sent = sendGso(socket)) < 0){
+        rc = SOCK352_FAILURE; 
+        sent = socket->n_tx; 
+    }
+
+    memset(msgs, 0, socket->n_tx * sizeof(struct mmsghdr)); 
+    for(i=0;i<socket->n_tx;i++){
+        iovs[i].iov_base = &socket->tx_batch[i]->header; 
+        iovs[i].iov_len = packetLength(socket->tx_batch[i]); 
+        msgs[i].msg_hdr.msg_name = socket->other; 
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in); 
+        msgs[i].msg_hdr.msg_iov = &iovs[i]; 
+        msgs[i].msg_hdr.msg_iovlen = 1; 
+    }
+
+    /* 
+     * sendmmsg may stop early -- keep going from where it stopped 
+     */
+    while(sent < socket->n_tx){
+        int n = sendmmsg(socket->sock_fd, msgs + sent, socket->n_tx - sent, 0); 
+        if(n < 0){
+            if(errno == EINTR) continue; 
+            printf("Failed to send packets in flushBatch(): %s\n", strerror(errno)); 
+            rc = SOCK352_FAILURE; 
+            break; 
+        }
+        socket->stats.send_batches++; 
+        socket->stats.send_batch_packets += n; 
+        sent += n; 
+    }
+
+    for(i=0;i<socket->n_tx;i++){
+        socket->tx_batch[i]->batched = 0; 
+        if(socket->tx_owned[i]) freePacket(socket->tx_batch[i]); 
+    }
+    socket->n_tx = 0; 
+
+    return rc; 
+}
+
+/* 
+ * Send a packet to the other end of the connection -- it goes out with 
+ * the next flush of the send batch 
+ * owned packets are freed once they are sent
+ */
+int sendPacket(socket352_t *socket, packet_t *packet, int owned){
+    socket->stats.packets_sent++; 
+
+    /* 
+     * Emulated loss -- pretend the network dropped it 
+     */
+    if(socket->loss_rate > 0 && rand() % 100 < socket->loss_rate){
+        if(owned) freePacket(packet); 
+        return SOCK352_SUCCESS; 
+    }
+
+    /* 
+     * Already waiting in the batch (resent before the flush) 
+     */
+    if(packet->batched) return SOCK352_SUCCESS; 
+
+    packet->batched = 1; 
+    socket->tx_batch[socket->n_tx] = packet; 
+    socket->tx_owned[socket->n_tx] = owned; 
+    socket->n_tx++; 
+
+    if(socket->n_tx == SOCK352_BATCH_SIZE) return flushBatch(socket); 
+
+    return SOCK352_SUCCESS; 
+}
+
+/* 
+ * Send (or resend) a packet from the transmit list and start the 
+ * retransmission timer if it isn't running -- it carries a cumulative 
+ * ACK, so the other side learns what we got even when our ACKs are lost 
+ * (a listener's SYN cookie check relies on it when the handshake ACK is) 
+ */
+int transmitPacket(socket352_t *socket, packet_t *packet){
+    packet->header.flags |= SOCK352_ACK; 
+    packet->header.ack_no = socket->recv_next; 
+
+    packet->sent_usec = nowUsec(); 
+    if(socket->rto_deadline == 0) socket->rto_deadline = packet->sent_usec + currentRto(socket); 
+    pacePacket(socket, packet->sent_usec); 
+
+    return sendPacket(socket, packet, 0); 
+}
+
+/* 
+ * Send a cumulative ACK for everything received in order so far (only the 
+ * header and the SACK option go on the wire) -- an ACK still waiting in 
+ * the send batch is brought up to date instead 
+ */
+int sendAck(socket352_t *socket){
+    socket->ack_pending = 0; 
+    socket->ack_now = 0; 
+    socket->rx_unacked = 0; 
+    socket->ack_deadline = 0; 
+    socket->stats.acks_sent++; 
+
+    if(socket->ack_packet == NULL && (socket->ack_packet = allocPacket(socket)) == NULL) return SOCK352_FAILURE; 
+    packet_t *ack_packet = socket->ack_packet; 
+    memset(&ack_packet->header, 0, sizeof(sock352_pkt_hdr_t)); 
+    ack_packet->header.version = SOCK352_VER_1; 
+    ack_packet->header.header_len = (uint16_t)sizeof(sock352_pkt_hdr_t); 
+    ack_packet->header.flags = SOCK352_ACK; 
+    ack_packet->header.sequence_no = socket->seq_no; /* ACKs don't use up a sequence number */
+    ack_packet->header.ack_no = socket->recv_next; 
+
+    /* 
+     * Describe the out of order packets we hold in a SACK option 
+     */
+    if(socket->sack){
+        sock352_sack_block_t *blocks = (sock352_sack_block_t *)ack_packet->data; 
+        int n_blocks = 0; 
+
+        uint64_t seq = socket->recv_next; 
+        while(seq < socket->recv_high && n_blocks < SOCK352_MAX_SACK_BLOCKS){
+            seq = recvScan(socket, seq, socket->recv_high, 1); 
+            if(seq == socket->recv_high) break; 
+
+            blocks[n_blocks].start = seq; 
+            blocks[n_blocks].end = seq = recvScan(socket, seq, socket->recv_high, 0); 
+            n_blocks++; 
+        }
+
+        if(n_blocks > 0){
+            ack_packet->header.flags |= SOCK352_HAS_OPT; 
+            ack_packet->header.opt_ptr = SOCK352_OPT_TYPE_SACK; 
+            ack_packet->header.header_len += n_blocks * sizeof(sock352_sack_block_t); 
+        }
+    }
+
+    return sendPacket(socket, ack_packet, 0); 
+}
+
+/* 
+ * Mark the packets covered by the SACK option of an ACK and count them in delivered 
+ * returns the send time of the newest newly SACKed packet that was only sent once 
+ */
+uint64_t handleSack(socket352_t *socket, packet_t *packet, int *delivered){
+    uint64_t sent_usec = 0; 
+
+    if((packet->header.flags & SOCK352_HAS_OPT) != SOCK352_HAS_OPT || packet->header.opt_ptr != SOCK352_OPT_TYPE_SACK) return 0; 
+
+    int n_blocks = (packet->header.header_len - sizeof(sock352_pkt_hdr_t)) / sizeof(sock352_sack_block_t); 
+    if(n_blocks > SOCK352_MAX_SACK_BLOCKS) n_blocks = SOCK352_MAX_SACK_BLOCKS; 
+
+    sock352_sack_block_t *blocks = (sock352_sack_block_t *)packet->data; 
+    int i=0; 
+    for(;i<n_blocks;i++){
+        packet_t *ptr = socket->unack_packets; 
+        for(;ptr != NULL;ptr = ptr->next){
+            uint64_t seq = ptr->header.sequence_no; 
+            if(seq < blocks[i].start || ptr->sacked) continue; 
+            if(seq >= blocks[i].end) break; 
+
+            ptr->sacked = 1; 
+            socket->n_sacked++; 
+            if(ptr->lost){
+                ptr->lost = 0; 
+                socket->n_lost--; 
+            }
+            (*delivered)++; 
+            if(ptr->retransmits == 0) sent_usec = ptr->sent_usec; 
+        }
+    }
+
+    return sent_usec; 
+}
+
+/* 
+ * Resend packets marked lost, oldest first, as far as the congestion 
+ * window allows 
+ */
+int retransmitLost(socket352_t *socket){
+    packet_t *ptr = socket->unack_packets; 
+    for(;ptr != NULL && socket->n_lost > 0;ptr = ptr->next){
+        if(!ptr->lost) continue; 
+        if(packetsInFlight(socket) >= (int)socket->cc.cwnd && packetsInFlight(socket) > 0) break; 
+
+        ptr->lost = 0; 
+        socket->n_lost--; 
+        ptr->retransmits++; 
+        socket->stats.retransmits++; 
+        if(transmitPacket(socket, ptr) < 0) return SOCK352_FAILURE; 
+    }
+
+    return 0; 
+}
+
+/* 
+ * Find the holes -- unSACKed packets with at least SOCK352_DUP_THRESH 
+ * SACKed packets above them are considered lost -- and resend them 
+ */
+int retransmitHoles(socket352_t *socket){
+    int sacked_above = 0; 
+
+    packet_t *ptr = socket->unack_tail; 
+    for(;ptr != NULL;ptr = ptr->prev){
+        if(ptr->sacked){
+            sacked_above++; 
+            continue; 
+        }
+
+        if(sacked_above >= SOCK352_DUP_THRESH && !ptr->fast_retransmitted && !ptr->lost){
+            congestionEvent(socket, ptr, 0); 
+            ptr->fast_retransmitted = 1; 
+            ptr->lost = 1; 
+            socket->n_lost++; 
+        }
+    }
+
+    return retransmitLost(socket); 
+}
+
+/* 
+ * Can the app's next write still go into this queued packet? (not a FIN, 
+ * not full) 
+ */
+int packetOpen(socket352_t *socket, packet_t *packet){
+    return !(packet->header.flags & SOCK352_FIN) && packet->size < (uint32_t)socket->mss; 
+}
+
+/* 
+ * May a queued packet go out now? Everything but a partial packet at the 
+ * tail of the send buffer may -- that one waits for more data while 
+ * corked (up to SOCK352_CORK_TIMEOUT), or (Nagle) while data is in flight, 
+ * unless it was flushed 
+ */
+int packetReady(socket352_t *socket, packet_t *packet){
+    if(packet != socket->send_tail || !packetOpen(socket, packet)) return 1; 
+    if(packet->header.sequence_no < socket->push_seq) return 1; 
+    if(socket->cork) return nowUsec() >= packet->queued_usec + SOCK352_CORK_TIMEOUT; 
+
+    return socket->nodelay || socket->n_unacked == 0; 
+}
+
+/* 
+ * Move packets from the send buffer into the network as far as the 
+ * window and the pacing timer allow 
+ */
+int sendQueued(socket352_t *socket){
+    while(socket->send_queue != NULL && windowOpen(socket) && packetReady(socket, socket->send_queue) && paceOpen(socket)){
+        packet_t *packet = popSendPacket(socket); 
+        addTransPacket(socket, packet); 
+        if(transmitPacket(socket, packet) < 0) return SOCK352_FAILURE; 
+    }
+
+    return 0; 
+}
+
+/* 
+ * When does the connection next need the engine (usec)? 0 if only 
+ * when a packet arrives 
+ */
+uint64_t nextDeadline(socket352_t *socket){
+    /* 
+     * A listener drops its oldest half-open connection at some point 
+     */
+    if(socket->state == LISTEN) return (socket->pending != NULL) ? socket->pending->syn_usec + SOCK352_SYN_TIMEOUT : 0; 
+
+    uint64_t deadline = socket->rto_deadline; 
+
+    if(socket->ack_deadline != 0 && (deadline == 0 || socket->ack_deadline < deadline)) deadline = socket->ack_deadline; 
+    if(socket->probe_deadline != 0 && (deadline == 0 || socket->probe_deadline < deadline)) deadline = socket->probe_deadline; 
+
+    /* 
+     * Queued data the window lets out goes at the pacing time, or right away 
+     * -- a corked partial packet when the cork times out 
+     */
+    if(socket->send_queue != NULL && windowOpen(socket)){
+        uint64_t send_at = 0; 
+        if(packetReady(socket, socket->send_queue)){
+            send_at = socket->pacing ? socket->pace_next : 0; 
+            if(send_at == 0) send_at = 1; 
+        }
+        else if(socket->cork) send_at = socket->send_queue->queued_usec + SOCK352_CORK_TIMEOUT; 
+        if(send_at != 0 && (deadline == 0 || send_at < deadline)) deadline = send_at; 
+    }
+
+    return deadline; 
+}
+
+/* 
+ * An ACK arrived -- everything below ack_no has been received by the other, 
+ * plus whatever its SACK option lists 
+ */
+int handleAck(socket352_t *socket, packet_t *packet){
+    uint64_t sent_usec = 0; 
+    int acked = 0; 
+    int delivered = 0; /* packets that left the network with this ACK */
+    int ambiguous = 0; /* the ACK covers a retransmission -- it may have been sent for it */
+
+    while(socket->unack_packets != NULL && socket->unack_packets->header.sequence_no < packet->header.ack_no){
+        /* 
+         * Karn's algorithm -- only time packets that were sent once 
+         * (and weren't already SACKed, they were waiting on a hole)
+         */
+        packet_t *head = socket->unack_packets; 
+        if(head->retransmits == 0 && !head->sacked) sent_usec = head->sent_usec; 
+        if(head->retransmits > 0) ambiguous = 1; 
+        if(!head->sacked) delivered++; 
+
+        removeTransPacket(socket, head); 
+        acked++; 
+    }
+
+    uint64_t sacked_usec = handleSack(socket, packet, &delivered); 
+    if(sacked_usec > sent_usec) sent_usec = sacked_usec; 
+
+    /* 
+     * An ACK that also covers a retransmission may have been triggered by 
+     * it (the ACKs for the originals were lost) -- its timing says nothing 
+     * about the original packets 
+     */
+    if(sent_usec > 0 && !ambiguous) updateRtt(socket, nowUsec() - sent_usec); 
+
+    /* 
+     * Grow the congestion window, except while recovering from a loss 
+     * found by SACKs (after a timeout we slow start through recovery)
+     */
+    uint64_t una = (socket->unack_packets != NULL) ? socket->unack_packets->header.sequence_no : socket->seq_no; 
+    if(una >= socket->recovery_point) socket->rto_recovery = 0; 
+    if(delivered > 0 && (una >= socket->recovery_point || socket->rto_recovery)){
+        socket->cc.algorithm->on_ack(&socket->cc, delivered, socket->srtt, nowUsec()); 
+        if(socket->cc.cwnd > socket->window) socket->cc.cwnd = socket->window; 
+    }
+
+    if(acked > 0){
+        /* 
+         * Progress -- drop the backoff and restart the timer for whatever 
+         * is still outstanding 
+         */
+        socket->backoffs = 0; 
+        socket->rto_deadline = (socket->unack_packets != NULL) ? nowUsec() + currentRto(socket) : 0; 
+    }
+
+    return retransmitHoles(socket); 
+}
+
+/* 
+ * The retransmission timer fired -- back off, mark everything that is 
+ * still unacknowledged and wasn't SACKed as lost and resend it as the 
+ * (collapsed) congestion window allows 
+ * returns -1 once the other side has stopped answering
+ */
+int handleTimeout(socket352_t *socket){
+    socket->stats.timeouts++; 
+
+    if(socket->backoffs == 0 && socket->unack_packets != NULL) congestionEvent(socket, socket->unack_packets, 1); 
+
+    if(++socket->backoffs > SOCK352_MAX_RETRIES){
+        printf("Connection timed out after %d retransmissions\n", SOCK352_MAX_RETRIES); 
+        return SOCK352_FAILURE; 
+    }
+
+    socket->rto_deadline = 0; 
+    packet_t *packet = socket->unack_packets; 
+    for(;packet != NULL;packet = packet->next){
+        if(packet->sacked || packet->lost) continue; 
+
+        packet->fast_retransmitted = 0; 
+        packet->lost = 1; 
+        socket->n_lost++; 
+    }
+
+    return retransmitLost(socket); 
+}
+
+/* 
+ * A data (or FIN) packet arrived -- keep it in the received list (in or 
+ * out of order), move recv_next past everything now in order, then ACK. 
+ * The ACK goes out once the whole receive batch is processed. 
+ * returns 1 if the packet was kept, 0 if it was a duplicate
+ */
+int handleData(socket352_t *socket, packet_t *packet){
+    packet->size = ntohs(packet->header.payload_len); 
+    socket->ack_pending = 1; 
+    socket->stats.data_received++; 
+
+    /* 
+     * Duplicates of old packets (or of buffered ones) are dropped and re-ACKed 
+     * right away 
+     */
+    if(packet->header.sequence_no < socket->recv_next || addRecvPacket(socket, packet) < 0){
+        socket->ack_now = 1; 
+        return 0; 
+    }
+
+    /* 
+     * Out of order data, data that fills a hole and the FIN are ACKed at 
+     * the end of the batch (the sender is waiting to hear about them), 
+     * in-order data every ack_every packets or once ack_delay has passed 
+     */
+    if(packet->header.sequence_no != socket->recv_next || packet->header.sequence_no + 1 < socket->recv_high || (packet->header.flags & SOCK352_FIN)){
+        socket->ack_now = 1; 
+    }
+    else if(++socket->rx_unacked >= socket->ack_every) socket->ack_now = 1; 
+
+    if(socket->ack_deadline == 0) socket->ack_deadline = nowUsec() + socket->ack_delay; 
+
+    /* 
+     * Advance past the packets that are now in order 
+     */
+    while(recvPresent(socket, socket->recv_next)){
+        uint64_t seq = socket->recv_next++; 
+
+        /* 
+         * The FIN isn't data for the app (it is the last packet, the 
+         * app's reads stop in front of it) 
+         */
+        packet_t *ptr = socket->recv_ring[seq & (socket->recv_size - 1)]; 
+        if(ptr->header.flags & SOCK352_FIN){
+            socket->peer_fin = 1; 
+            freePacket(removeRecvPacket(socket, seq)); 
+        }
+    }
+
+    return 1; 
+}
+
+/* 
+ * Process one packet from the other side 
+ * returns 1 if the packet was kept, 0 if its buffer can be reused, -1 on error
+ */
+int processPacket(socket352_t *socket, packet_t *packet){
+    /* 
+     * A repeated SYN means our SYN|ACK was lost -- send it again, with the 
+     * same sequence number, while the handshake is open. A SYN|ACK on a 
+     * connected socket means the other side never got our ACK 
+     */
+    if(packet->header.flags & SOCK352_SYN){
+        if(socket->state == SYN_RECEIVED && !(packet->header.flags & SOCK352_ACK)){
+            socket->backoffs++; 
+            sendSynAck(socket->listener, packet, socket->other, socket->syn_seq, 
+                       packet->header.sequence_no + (socket->fast_open ? 2 : 1)); 
+        }
+        else if(socket->state == ESTABLISHED && (packet->header.flags & SOCK352_ACK)){
+            socket->ack_pending = socket->ack_now = 1; 
+        }
+        return 0; 
+    }
+
+    /* 
+     * Anything else shows the client got our SYN|ACK 
+     */
+    if(socket->state == SYN_RECEIVED) socket->state = ESTABLISHED; 
+
+    /* 
+     * Path MTU probes live outside the sequence space 
+     */
+    if(packet->header.flags & SOCK352_PROBE) return handleProbe(socket, packet); 
+
+    /* 
+     * The ACK riding on a data packet mostly repeats the last one -- it 
+     * only needs handling when it ACKs something new 
+     */
+    if(packet->header.flags & SOCK352_ACK){
+        uint64_t una = (socket->unack_packets != NULL) ? socket->unack_packets->header.sequence_no : socket->seq_no; 
+        if(packet->header.payload_len == 0 || packet->header.ack_no > una){
+            if(handleAck(socket, packet) < 0) return SOCK352_FAILURE; 
+        }
+    }
+
+    /* 
+     * Anything carrying data or a FIN is part of the other's sequence space 
+     */
+    if(packet->header.payload_len != 0 || (packet->header.flags & SOCK352_FIN)){
+        return handleData(socket, packet); 
+    }
+
+    return 0; 
+}
+
+/* 
+ * A packet arrived on a listener's UDP socket -- hand it to its connection, 
+ * or start a handshake if it is a SYN from a new client 
+ * returns 1 if the packet was kept, 0 if its buffer can be reused
+ */
+int routePacket(socket352_t *listener, packet_t *packet, struct sockaddr_in *from){
+    socket352_t *client = findDemux(listener, from, packet->header.source_port); 
+
+    /* 
+     * A closed listener only routes for the connections it still has 
+     */
+    if(client == NULL && listener->state != LISTEN) return 0; 
+
+    if(client == NULL && packet->header.flags == SOCK352_SYN){
+        startHandshake(listener, packet, from); 
+        return 0; 
+    }
+
+    /* 
+     * Anything else from an unknown client has to carry a SYN cookie 
+     */
+    if(client == NULL){
+        if(!listener->syn_cookies || !(packet->header.flags & SOCK352_ACK)) return 0; 
+        if((client = checkCookie(listener, packet, from)) == NULL) return 0; 
+    }
+
+    lockSocket(client); 
+
+    int state = client->state; 
+    int rc = 0; 
+    if(!client->error && (rc = processPacket(client, packet)) < 0){
+        client->error = 1; 
+        rc = 0; 
+    }
+
+    if(state == SYN_RECEIVED && client->state != SYN_RECEIVED) finishHandshake(listener, client); 
+
+    /* 
+     * The engine lets the connection ACK and send once the batch is done 
+     */
+    if(!client->is_routed){
+        client->is_routed = 1; 
+        listener->routed[listener->n_routed++] = client; 
+    }
+
+    unlockSocket(client); 
+
+    return rc; 
+}
+
+/* 
+ * Process one packet from the other side -- a listener passes it on to 
+ * the connection it belongs to
+ * returns 1 if the packet was kept, 0 if its buffer can be reused, -1 on error
+ */
+int deliverPacket(socket352_t *socket, packet_t *packet, struct sockaddr_in *from){
+    if(socket->is_listener) return routePacket(socket, packet, from); 
+    return processPacket(socket, packet); 
+}
+
+/* 
+ * ACK the data of a receive batch if it can't wait, or once the delayed 
+ * ACK timer is due 
+ * a connection nobody accepted yet (no fd) doesn't wait -- the engine 
+ * doesn't run its timers
+ */
+int finishBatch(socket352_t *socket){
+    if(!socket->ack_pending) return SOCK352_SUCCESS; 
+
+    if(!socket->ack_now && socket->ack_delay != 0 && socket->fd != 0 && nowUsec() < socket->ack_deadline){
+        return SOCK352_SUCCESS; 
+    }
+    return sendAck(socket); 
+}
+
+/* 
+ * Turn UDP GRO on or off for the UDP socket 
+ */
+int setGro(socket352_t *socket, int on){
+    if(setsockopt(socket->sock_fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0){
+        printf("Failed to set UDP_GRO in setGro(): %s\n", strerror(errno)); 
+        return SOCK352_FAILURE; 
+    }
+    socket->gro_on = on; 
+    return SOCK352_SUCCESS; 
+}
+
+/* 
+ * Receive a batch of UDP GRO buffers with recvmmsg, split the coalesced 
+ * datagrams back into packets and process them 
+ * returns the number of packets received, 0 if none were waiting, -1 on error
+ */
+int receiveGro(socket352_t *socket){
+    struct mmsghdr msgs[SOCK352_GRO_BUFFERS]; 
+    struct iovec iovs[SOCK352_GRO_BUFFERS]; 
+    struct sockaddr_in from[SOCK352_GRO_BUFFERS]; 
+    char controls[SOCK352_GRO_BUFFERS][CMSG_SPACE(sizeof(int))]; 
+
+    if(socket->gro_buffers == NULL) socket->gro_buffers = (char *)malloc(SOCK352_GRO_BUFFERS * SOCK352_GRO_BUFFER); 
+
+    memset(msgs, 0, sizeof(msgs)); 
+    int i=0; 
+    for(;i<SOCK352_GRO_BUFFERS;i++){
+        iovs[i].iov_base = socket->gro_buffers + i * SOCK352_GRO_BUFFER; 
+        iovs[i].iov_len = SOCK352_GRO_BUFFER; 
+        msgs[i].msg_hdr.msg_name = &from[i]; 
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in); 
+        msgs[i].msg_hdr.msg_iov = &iovs[i]; 
+        msgs[i].msg_hdr.msg_iovlen = 1; 
+        msgs[i].msg_hdr.msg_control = controls[i]; 
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]); 
+    }
+
+    int n = recvmmsg(socket->sock_fd, msgs, SOCK352_GRO_BUFFERS, MSG_DONTWAIT, NULL); 
+    if(n < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0; 
+        printf("Failed to receive packets in receiveGro(): %s\n", strerror(errno)); 
+        return SOCK352_FAILURE; 
+    }
+
+    int packets = 0; 
+    for(i=0;i<n;i++){
+        char *buffer = socket->gro_buffers + i * SOCK352_GRO_BUFFER; 
+        int len = msgs[i].msg_len; 
+
+        /* 
+         * A buffer that didn't fit can't be cut into its datagrams -- the 
+         * sender retransmits them 
+         */
+        if(msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+            socket->stats.bad_packets++; 
+            continue; 
+        }
+
+        /* 
+         * The segment size is only there when datagrams were coalesced 
+         * (a size of 0 would never get through the buffer -- one datagram) 
+         */
+        int segment = len; 
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); 
+        for(;cmsg != NULL;cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)){
+            if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) segment = *(int *)CMSG_DATA(cmsg); 
+        }
+        if(segment <= 0 || segment > len) segment = len; 
+        if(segment < len){
+            socket->stats.gro_receives++; 
+            socket->stats.gro_packets += len / segment; 
+        }
+
+        /* 
+         * Datagrams are cut at the segment size, the last may be shorter 
+         */
+        int offset = 0; 
+        for(;offset < len;offset += segment){
+            int size = len - offset; 
+            if(size > segment) size = segment; 
+            if(size > MAX_UDP_PACKET_SIZE){
+                socket->stats.bad_packets++; 
+                continue; 
+            }
+
+            if(socket->rx_batch[0] == NULL && (socket->rx_batch[0] = allocPacket(socket)) == NULL) return SOCK352_FAILURE; 
+            memcpy(&socket->rx_batch[0]->header, buffer + offset, size); 
+            if(!checkPacket(socket->rx_batch[0], size)){
+                socket->stats.bad_packets++; 
+                continue; 
+            }
+
+            int rc = deliverPacket(socket, socket->rx_batch[0], &from[i]); 
+            if(rc < 0) return SOCK352_FAILURE; 
+            if(rc == 1) socket->rx_batch[0] = NULL; /* kept in the received list */
+            packets++; 
+        }
+    }
+
+    socket->stats.recv_batches++; 
+    socket->stats.recv_batch_packets += packets; 
+
+    if(finishBatch(socket) < 0) return SOCK352_FAILURE; 
+
+    return packets; 
+}
+
+/* 
+ * Receive a batch of packets from the other side with recvmmsg and 
+ * process them 
+ * returns the number of packets received, 0 if none were waiting, -1 on error
+ */
+int receiveBatch(socket352_t *socket){
+    struct mmsghdr msgs[SOCK352_BATCH_SIZE]; 
+    struct iovec iovs[SOCK352_BATCH_SIZE]; 
+    struct sockaddr_in from[SOCK352_BATCH_SIZE]; 
+
+    if(socket->gro && !socket->gro_on && setGro(socket, 1) < 0) socket->gro = 0; 
+    if(socket->gro_on) return receiveGro(socket); 
+
+    /* 
+     * Replace the buffers that were kept by the last batch 
+     */
+    memset(msgs, 0, sizeof(msgs)); 
+    int i=0; 
+    for(;i<SOCK352_BATCH_SIZE;i++){
+        if(socket->rx_batch[i] == NULL && (socket->rx_batch[i] = allocPacket(socket)) == NULL) return SOCK352_FAILURE; 
+        iovs[i].iov_base = &socket->rx_batch[i]->header; 
+        iovs[i].iov_len = MAX_UDP_PACKET_SIZE; 
+        msgs[i].msg_hdr.msg_name = &from[i]; 
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in); 
+        msgs[i].msg_hdr.msg_iov = &iovs[i]; 
+        msgs[i].msg_hdr.msg_iovlen = 1; 
+    }
+
+    int n = recvmmsg(socket->sock_fd, msgs, SOCK352_BATCH_SIZE, MSG_DONTWAIT, NULL); 
+    if(n < 0){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0; 
+        printf("Failed to receive packets in receiveBatch(): %s\n", strerror(errno)); 
+        return SOCK352_FAILURE; 
+    }
+
+    socket->stats.recv_batches++; 
+    socket->stats.recv_batch_packets += n; 
+
+    for(i=0;i<n;i++){
+        if((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || !checkPacket(socket->rx_batch[i], msgs[i].msg_len)){
+            socket->stats.bad_packets++; 
+            continue; 
+        }
+
+        int rc = deliverPacket(socket, socket->rx_batch[i], &from[i]); 
+        if(rc < 0) return SOCK352_FAILURE; 
+        if(rc == 1) socket->rx_batch[i] = NULL; /* kept in the received list */
+    }
+
+    if(finishBatch(socket) < 0) return SOCK352_FAILURE; 
+
+    return n; 
+}
+
+/* 
+ * Free the receive buffers 
+ */
+int freeBatch(socket352_t *socket){
+    int i=0; 
+    for(;i<SOCK352_BATCH_SIZE;i++){
+        freePacket(socket->rx_batch[i]); 
+        socket->rx_batch[i] = NULL; 
+    }
+    free(socket->gso_buffer); 
+    socket->gso_buffer = NULL; 
+    free(socket->gro_buffers); 
+    socket->gro_buffers = NULL; 
+    freePacket(socket->ack_packet); 
+    socket->ack_packet = NULL; 
+    freePacket(socket->probe_packet); 
+    socket->probe_packet = NULL; 
+    return 0; 
 }
 
 /* Socket hash table functions */
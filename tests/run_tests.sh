@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Protocol tests for CS352 RDP -- each line is one transfer through the
+# lossy proxy of test_transfer; run with 'make test'
+#
+
+cd "$(dirname "$0")" || exit 1
+
+failed=0
+
+run(){
+    echo "--- test_transfer $*"
+    ./test_transfer "$@" || failed=$((failed + 1))
+}
+
+echo "--- test_recv_ring"
+./test_recv_ring || failed=$((failed + 1))
+
+echo "--- test_epoll"
+./test_epoll || failed=$((failed + 1))
+
+# clean path
+run -n 2000000
+
+# loss and reordering (a small MSS makes for many datagrams)
+run -n 2000000 -l 5 -o SOCK352_MSS=1000
+run -n 2000000 -r 10 -o SOCK352_MSS=1000
+run -n 1000000 -l 3 -r 5 -w 100 -o SOCK352_MSS=1000
+
+# handshake loss: the SYN, the SYN|ACK, the handshake ACK, and a
+# SYN|ACK lost again after the resent SYN
+run -n 200000 -d c1
+run -n 200000 -d s1
+run -n 200000 -d c2
+run -n 200000 -d s1 -d s2
+run -n 200000 -d c1 -D 500
+
+# SYN data: without a fast open cookie it is sent after the handshake,
+# with one (-k connects once first to get it) the server takes it from
+# the SYN; more than a packet of it goes out as a write
+run -n 200000 -D 500
+run -n 200000 -D 500 -k
+run -n 200000 -D 5000
+run -n 200000 -D 5000 -k
+run -n 1000000 -D 3000 -k -l 5 -o SOCK352_MSS=1000
+
+# with SYN cookies the listener keeps no state until the handshake ACK
+# or the first data (which ACKs too) shows up
+run -n 200000 -o SOCK352_SYNCOOKIES=2
+run -n 200000 -d c2 -o SOCK352_SYNCOOKIES=2
+run -n 200000 -d c2 -D 500 -o SOCK352_SYNCOOKIES=2
+run -n 1000000 -l 5 -o SOCK352_SYNCOOKIES=2 -o SOCK352_MSS=1000
+
+# the server closes its listener while the accepted connection, which
+# shares the listener's UDP socket, still has its transfer ahead
+run -n 1000000 -c
+run -n 1000000 -c -l 5 -o SOCK352_MSS=1000
+
+# the data comes from a file with sock352_sendfile (the SYN data from the
+# start of it, the rest from an offset) and goes into one with
+# sock352_recvfile, in more than one 16 MB mapping
+run -n 20000000 -F
+run -n 1000000 -F -D 500 -l 3 -o SOCK352_MSS=1000
+
+# scatter/gather: writev and readv over empty iovecs, tiny ones and ones
+# across packet boundaries
+run -n 3000000 -v
+run -n 1000000 -v -D 500 -l 3 -r 5 -o SOCK352_MSS=1000
+
+# UDP GSO sends and GRO receives, with pacing off so the sender has runs
+# of packets to coalesce -- the proxy passes coalesced datagrams on
+# coalesced, so the receiver splits real GRO buffers
+run -n 5000000 -o SOCK352_GSO=1 -o SOCK352_GRO=1 -o SOCK352_PACING=0 -o SOCK352_MSS=1000
+run -n 5000000 -l 3 -r 5 -o SOCK352_GSO=1 -o SOCK352_GRO=1 -o SOCK352_PACING=0 -o SOCK352_MSS=1000
+
+# a 20 MB/s bottleneck with a 15 KB drop-tail queue, with pacing on and
+# off -- compare the drops and queueing delays the two report
+run -n 4000000 -q 20000:15 -o SOCK352_MSS=1400 -o SOCK352_PACING=1
+run -n 4000000 -q 20000:15 -o SOCK352_MSS=1400 -o SOCK352_PACING=0
+
+if [ $failed -ne 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi
+echo "all tests passed"
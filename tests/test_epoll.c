@@ -0,0 +1,241 @@
+/*
+ * Readiness test for sock352_epoll_create/ctl/wait
+ *
+ * A server (forked child) waits for its connections through a
+ * sock352_epoll set on the listener and answers every 'x' that arrives
+ * on the first one with a burst on the second ('c' closes the third).
+ * The client registers its connections and checks that they are
+ * reported writable, that only the one with data waiting is reported
+ * readable (and no longer once it was read), that a connection removed
+ * with SOCK352_EPOLL_CTL_DEL or closed is not reported at all, and that
+ * bad arguments are refused.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "sock352.h"
+
+#define N_CONNS 3
+#define BURST 100
+
+int failures = 0;
+
+void timedOut(int sig){
+    const char msg[] = "FAIL: timed out\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+void expect(int cond, const char *what){
+    if(!cond){
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/*
+ * Read exactly count bytes
+ */
+int readFull(int fd, char *buf, int count){
+    int got = 0;
+    while(got < count){
+        int rc = sock352_read(fd, buf + got, count - got);
+        if(rc <= 0) return -1;
+        got += rc;
+    }
+    return 0;
+}
+
+/*
+ * Wait once, return the events reported for fd (0 if none) and count
+ * the events in *n
+ */
+uint32_t waitFor(int epfd, int fd, int timeout, int *n){
+    sock352_epoll_event_t events[8];
+    uint32_t found = 0;
+    *n = sock352_epoll_wait(epfd, events, 8, timeout);
+    int i=0;
+    for(;i<*n;i++){
+        if(events[i].fd == fd) found = events[i].events;
+    }
+    return found;
+}
+
+/*
+ * The server end: accept through the listener's readiness, then do what
+ * the bytes on the first connection say
+ */
+int runServer(int port){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, 5) < 0){
+        printf("FAIL: server: bind/listen failed\n");
+        return 1;
+    }
+
+    int epfd = sock352_epoll_create(1);
+    sock352_epoll_event_t event = { SOCK352_EPOLLIN, listen_fd };
+    if(epfd < 0 || sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, listen_fd, &event) < 0){
+        printf("FAIL: server: registering the listener failed\n");
+        return 1;
+    }
+
+    int fds[N_CONNS], i=0;
+    for(;i<N_CONNS;i++){
+        int n;
+        if(!(waitFor(epfd, listen_fd, 5000, &n) & SOCK352_EPOLLIN)){
+            printf("FAIL: server: listener not readable with a connection to accept\n");
+            return 1;
+        }
+        int len = sizeof(addr);
+        if((fds[i] = sock352_accept(listen_fd, &addr, &len)) < 0){
+            printf("FAIL: server: accept failed\n");
+            return 1;
+        }
+    }
+
+    char c, burst[BURST];
+    memset(burst, 'b', sizeof(burst));
+    while(sock352_read(fds[0], &c, 1) == 1){
+        if(c == 'c') sock352_close(fds[2]);
+        else if(sock352_write(fds[1], burst, BURST) != BURST) return 1;
+    }
+    sock352_close(fds[0]);
+    sock352_close(fds[1]);
+    return 0;
+}
+
+/*
+ * The client end: the readiness checks
+ */
+int runClient(int port){
+    sock352_init(port);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    errno = 0;
+    expect(sock352_epoll_create(0) < 0 && errno == EINVAL, "epoll set of size 0 created");
+
+    int epfd = sock352_epoll_create(1);
+    if(epfd < 0){
+        printf("FAIL: client: epoll create failed\n");
+        return 1;
+    }
+
+    int fds[N_CONNS], i=0;
+    for(;i<N_CONNS;i++){
+        fds[i] = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+        if(sock352_connect(fds[i], &addr, sizeof(addr)) < 0){
+            printf("FAIL: client: connect failed\n");
+            return 1;
+        }
+        sock352_setsockopt(fds[i], SOCK352_OPT_NODELAY, 1);
+        sock352_epoll_event_t event = { SOCK352_EPOLLIN | SOCK352_EPOLLOUT, fds[i] };
+        expect(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, fds[i], &event) == 0, "adding a connection failed");
+    }
+
+    /*
+     * Nothing sent yet: all writable, none readable
+     */
+    sock352_epoll_event_t events[8];
+    int n = sock352_epoll_wait(epfd, events, 8, 1000);
+    expect(n == N_CONNS, "not every connection reported");
+    for(i=0;i<n;i++){
+        expect(events[i].events == SOCK352_EPOLLOUT, "fresh connection not (only) writable");
+    }
+
+    /*
+     * From here on only readability
+     */
+    for(i=0;i<N_CONNS;i++){
+        sock352_epoll_event_t event = { SOCK352_EPOLLIN, fds[i] };
+        expect(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_MOD, fds[i], &event) == 0, "changing a connection's events failed");
+    }
+    waitFor(epfd, -1, 200, &n);
+    expect(n == 0, "connection without data reported readable");
+
+    /*
+     * A burst on the second connection makes it (and only it) readable,
+     * until it is read
+     */
+    char buf[BURST];
+    expect(sock352_write(fds[0], "x", 1) == 1, "write failed");
+    expect(waitFor(epfd, fds[1], 5000, &n) == SOCK352_EPOLLIN && n == 1, "connection with data not reported readable");
+    expect(readFull(fds[1], buf, BURST) == 0, "burst not read");
+    waitFor(epfd, -1, 200, &n);
+    expect(n == 0, "connection reported readable after its data was read");
+
+    /*
+     * Removed from the set it is not reported, though it has data
+     */
+    expect(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_DEL, fds[1], NULL) == 0, "removing a connection failed");
+    expect(sock352_write(fds[0], "x", 1) == 1, "write failed");
+    waitFor(epfd, -1, 500, &n);
+    expect(n == 0, "removed connection reported");
+    expect(readFull(fds[1], buf, BURST) == 0, "burst after removal not read");
+    expect(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_DEL, fds[1], NULL) < 0, "removing a connection twice succeeded");
+
+    /*
+     * Back in the set it is reported again
+     */
+    sock352_epoll_event_t event = { SOCK352_EPOLLIN | SOCK352_EPOLLOUT, fds[1] };
+    expect(sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_ADD, fds[1], &event) == 0, "adding a connection again failed");
+    expect(waitFor(epfd, fds[1], 1000, &n) == SOCK352_EPOLLOUT && n == 1, "connection added again not reported writable");
+    event.fd = fds[1];
+    event.events = SOCK352_EPOLLIN;
+    sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_MOD, fds[1], &event);
+
+    /*
+     * Closed (both ends) while in the set: it is not reported, though
+     * closing signalled it
+     */
+    event.fd = fds[2];
+    event.events = SOCK352_EPOLLIN | SOCK352_EPOLLOUT;
+    sock352_epoll_ctl(epfd, SOCK352_EPOLL_CTL_MOD, fds[2], &event);
+    expect(sock352_write(fds[0], "c", 1) == 1, "write failed");
+    sock352_close(fds[2]);
+    waitFor(epfd, -1, 200, &n);
+    expect(n == 0, "closed connection reported");
+
+    close(epfd);
+    sock352_close(fds[0]);
+    sock352_close(fds[1]);
+    return 0;
+}
+
+int main(){
+    setvbuf(stdout, NULL, _IOLBF, 0); /* keep the two processes' lines whole */
+    int port = 20000 + (getpid() % 2000) * 16 + 8;
+
+    fflush(stdout);
+    signal(SIGALRM, timedOut);
+    pid_t pid = fork();
+    if(pid == 0){
+        alarm(30);
+        exit(runServer(port));
+    }
+    alarm(30);
+    usleep(200000); /* let the server get to listen */
+
+    int rc = runClient(port);
+
+    int status;
+    if(rc != 0) kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if(rc == 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) failures++;
+
+    if(rc == 0 && failures == 0) printf("PASS: epoll readiness\n");
+    return rc != 0 || failures != 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Unit test for the receive ring of CS352 RDP
+ *
+ * Includes the library source to reach addRecvPacket() and friends
+ * directly: packets far ahead of the ring (up to 2^63 sequence numbers)
+ * must be refused quickly, not loop or wrap the ring size.
+ */
+
+#include "sock352lib.c" /* first -- it sets _GNU_SOURCE */
+#include <signal.h>
+
+int failures = 0;
+
+/*
+ * The ring code looping forever shows up as a timeout
+ */
+void timedOut(int sig){
+    const char msg[] = "FAIL: timed out\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+void expect(int cond, const char *what){
+    if(!cond){
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+/*
+ * Offer the ring a packet with sequence number recv_next + ahead
+ */
+int addAhead(socket352_t *socket, packet_t *packet, uint64_t ahead){
+    memset(packet, 0, sizeof(*packet));
+    packet->header.sequence_no = socket->recv_next + ahead;
+    return addRecvPacket(socket, packet);
+}
+
+int main(){
+    static packet_t packets[6];
+    socket352_t *socket = (socket352_t *)calloc(1, sizeof(socket352_t));
+
+    signal(SIGALRM, timedOut);
+    alarm(5);
+
+    socket->recv_next = 1000;
+    expect(addAhead(socket, &packets[0], 0) == 0, "in-order packet refused");
+    expect(socket->recv_size == SOCK352_RECV_RING_MIN, "ring not at its minimum size");
+    expect(addAhead(socket, &packets[1], 0) < 0, "duplicate accepted");
+
+    expect(addAhead(socket, &packets[2], 1ULL << 63) < 0, "packet 2^63 ahead accepted");
+    expect(addAhead(socket, &packets[3], ~0ULL - socket->recv_next) < 0, "packet at UINT64_MAX accepted");
+    expect(addAhead(socket, &packets[4], SOCK352_RECV_RING_MAX) < 0, "packet a full ring ahead accepted");
+    expect(socket->recv_size == SOCK352_RECV_RING_MIN, "refused packets grew the ring");
+
+    expect(addAhead(socket, &packets[5], SOCK352_RECV_RING_MAX - 1) == 0, "packet at the ring's edge refused");
+    expect(socket->recv_size == SOCK352_RECV_RING_MAX, "ring not grown to its maximum");
+    expect(recvPresent(socket, 1000), "in-order packet lost by growing the ring");
+
+    expect(removeRecvPacket(socket, 1000) == &packets[0], "in-order packet not found");
+    expect(removeRecvPacket(socket, 1000 + SOCK352_RECV_RING_MAX - 1) == &packets[5], "edge packet not found");
+
+    if(failures == 0) printf("PASS: receive ring\n");
+    return failures != 0;
+}
@@ -0,0 +1,806 @@
+/*
+ * End-to-end transfer test for CS352 RDP
+ *
+ * A server (forked child) and a client exchange a byte pattern through a
+ * UDP proxy thread that can lose, reorder and drop chosen datagrams:
+ * the client sends -n bytes, the server checks them and sends -n bytes
+ * back, the client checks those. Every byte depends on its position, so
+ * anything lost, duplicated or out of order shows up.
+ *
+ * usage: test_transfer [-n bytes] [-w write size] [-D SYN data bytes] [-k] [-c] [-F] [-v]
+ *                      [-l loss %] [-r reorder %] [-d c<N>|s<N>]... [-q KB/s:queue KB]
+ *                      [-o NAME=VALUE]... [-t timeout sec] [-s seed]
+ *
+ *   -d c<N> drops the Nth datagram from the client (c1 is the SYN, c2
+ *   the handshake ACK), -d s<N> the Nth from the server (s1 is the
+ *   SYN|ACK); -o sets a SOCK352_* option in the environment of both ends;
+ *   -k connects once (through the proxy, counted in the datagram numbers)
+ *   before the transfer, so the client has a fast open cookie and the
+ *   server must take the -D data from the SYN; -c has the server close
+ *   its listener right after accepting, before the transfer; -F has the
+ *   client send from a temporary file with sock352_sendfile and the
+ *   server receive into one with sock352_recvfile; -v has both sides
+ *   write and read with sock352_writev/sock352_readv, over iovecs of
+ *   odd sizes (empty ones, and ones across packet boundaries); -q puts
+ *   a bottleneck link in both directions of the proxy, a drop-tail queue
+ *   of that many KB drained at that many KB/s (datagrams go through it
+ *   one by one, -r is ignored), and reports its drops and queueing delays
+ */
+
+#define _GNU_SOURCE /* ppoll */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include "sock352.h"
+
+#define MAX_DROPS 16
+#define PROXY_BUFFER 65536
+#define PROXY_MAX_SEGMENTS 64 /* datagrams the proxy coalesces into one GSO send at most */
+#define PROXY_HOLD_USEC 20000 /* a held (reordered) datagram goes out after this long at the latest */
+#define PROXY_MAX_QUEUED 4096 /* datagrams a bottleneck queue holds at most, whatever its size in bytes */
+#define PROXY_MAX_DELAYS (1 << 20) /* queueing delays kept for the bottleneck report */
+
+/*
+ * A datagram waiting in a bottleneck queue
+ */
+struct queued{
+    char *data;
+    int len;
+    uint64_t departure; /* when it leaves the link (usec) */
+};
+
+/*
+ * One direction of the bottleneck link (-q)
+ */
+struct bottleneck{
+    struct queued entries[PROXY_MAX_QUEUED]; /* FIFO */
+    int head;
+    int n; /* datagrams queued */
+    int bytes; /* bytes queued */
+    uint64_t last_departure; /* departure of the last datagram queued (usec) */
+};
+
+struct proxy{
+    int fd; /* the proxy's UDP socket, the client talks to it */
+    struct sockaddr_in server; /* where the server listens */
+    struct sockaddr_in client; /* learned from the first datagram */
+    int have_client;
+    int loss; /* percent of datagrams lost, both directions */
+    int reorder; /* percent of datagrams held back behind the next one */
+    int drops[2][MAX_DROPS]; /* datagram numbers to drop, per direction (0 client, 1 server) */
+    int n_drops[2];
+    int count[2]; /* datagrams seen per direction */
+    unsigned int seed;
+    long rate; /* -q: bottleneck rate (bytes/sec), 0 for none */
+    int queue_bytes; /* -q: bottleneck queue size */
+    struct bottleneck links[2]; /* per direction */
+    int queue_drops; /* datagrams dropped because the queue was full */
+    int queued; /* datagrams that went through the queue */
+    uint64_t *delays; /* their queueing delays (usec), at most PROXY_MAX_DELAYS */
+    volatile int stop;
+};
+
+/*
+ * Datagrams from one coalesced buffer the proxy passes on together
+ */
+struct run{
+    char buf[PROXY_BUFFER];
+    int len; /* bytes in buf */
+    int segment; /* size of the datagrams, the last may be shorter */
+    int n; /* number of datagrams */
+};
+
+struct proxy proxy;
+pid_t server_pid;
+int file_mode; /* -F: move the data with the file calls */
+int iov_mode; /* -v: move the data with the scatter/gather calls */
+
+/*
+ * Sizes of the iovecs -v writes and reads use, in turn -- empty ones,
+ * tiny ones, and ones bigger than a packet or several
+ */
+const int iov_sizes[] = { 0, 1, 5, 0, 1400, 9000, 2, 0, 700, 33000, 13, 8191, 0, 65536, 3 };
+#define N_IOV_SIZES (int)(sizeof(iov_sizes) / sizeof(iov_sizes[0]))
+#define IOV_GAP 16 /* bytes between the read iovecs, which readv must not touch */
+#define IOV_GAP_BYTE 0x5a
+
+/*
+ * Out of time -- report it and take the server down with us
+ */
+void timedOut(int sig){
+    const char msg[] = "FAIL: timed out\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    if(server_pid > 0) kill(server_pid, SIGKILL);
+    _exit(1);
+}
+
+/*
+ * Byte i of the pattern a side sends
+ */
+char patternByte(long i, int side){
+    return (char)((i * 7 + side * 101 + (i >> 8)) % 251);
+}
+
+/*
+ * Forward a datagram to the other end of its direction
+ */
+void proxySend(int dir, char *buf, int len){
+    struct sockaddr_in *to = (dir == 0) ? &proxy.server : &proxy.client;
+    sendto(proxy.fd, buf, len, 0, (struct sockaddr *)to, sizeof(*to));
+}
+
+/*
+ * Microseconds on the monotonic clock
+ */
+uint64_t proxyNow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Queue a datagram at the bottleneck -- dropped if the queue is full,
+ * else it leaves once the link sent everything ahead of it and itself
+ */
+void bottleneckAdd(int dir, char *data, int len){
+    struct bottleneck *link = &proxy.links[dir];
+    if(link->n == PROXY_MAX_QUEUED || (link->n > 0 && link->bytes + len > proxy.queue_bytes)){
+        proxy.queue_drops++;
+        return;
+    }
+
+    uint64_t now = proxyNow();
+    uint64_t start = (link->last_departure > now) ? link->last_departure : now;
+    struct queued *entry = &link->entries[(link->head + link->n) % PROXY_MAX_QUEUED];
+    entry->data = malloc(len);
+    memcpy(entry->data, data, len);
+    entry->len = len;
+    entry->departure = start + (uint64_t)len * 1000000 / proxy.rate;
+    link->last_departure = entry->departure;
+    link->n++;
+    link->bytes += len;
+
+    if(proxy.queued < PROXY_MAX_DELAYS) proxy.delays[proxy.queued] = entry->departure - now;
+    proxy.queued++;
+}
+
+/*
+ * Pass on what left the bottleneck by now, return the usec until the
+ * next departure (-1 if nothing is queued)
+ */
+long bottleneckFlush(){
+    uint64_t now = proxyNow();
+    long next = -1;
+    int dir=0;
+    for(;dir<2;dir++){
+        struct bottleneck *link = &proxy.links[dir];
+        while(link->n > 0 && link->entries[link->head].departure <= now){
+            struct queued *entry = &link->entries[link->head];
+            proxySend(dir, entry->data, entry->len);
+            free(entry->data);
+            link->bytes -= entry->len;
+            link->head = (link->head + 1) % PROXY_MAX_QUEUED;
+            link->n--;
+        }
+        if(link->n > 0){
+            long wait = (long)(link->entries[link->head].departure - now);
+            if(next < 0 || wait < next) next = wait;
+        }
+    }
+    return next;
+}
+
+int compareDelays(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Send the datagrams collected in a run -- several go out coalesced with
+ * UDP GSO, the way the sender sent them, so the receiver's GRO path gets
+ * coalesced buffers too
+ */
+void flushRun(int dir, struct run *run){
+    if(run->n > 1){
+        struct sockaddr_in *to = (dir == 0) ? &proxy.server : &proxy.client;
+        struct iovec iov = { run->buf, run->len };
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = to;
+        msg.msg_namelen = sizeof(*to);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cmsg) = run->segment;
+
+        /*
+         * No GSO here -- one by one
+         */
+        if(sendmsg(proxy.fd, &msg, 0) != run->len){
+            int offset = 0;
+            for(;offset < run->len;offset += run->segment){
+                proxySend(dir, run->buf + offset, (run->len - offset < run->segment) ? run->len - offset : run->segment);
+            }
+        }
+    }
+    else if(run->n == 1) proxySend(dir, run->buf, run->len);
+
+    run->len = run->n = 0;
+}
+
+/*
+ * Pass a datagram on at the end of the run -- a run holds datagrams of
+ * one size, only its last may be shorter
+ */
+void runAdd(int dir, struct run *run, char *data, int len){
+    if(run->n > 0 && (len > run->segment || run->len % run->segment != 0 || run->n == PROXY_MAX_SEGMENTS)) flushRun(dir, run);
+    if(run->n == 0) run->segment = len;
+    memcpy(run->buf + run->len, data, len);
+    run->len += len;
+    run->n++;
+}
+
+/*
+ * The proxy thread -- moves datagrams between the client and the server
+ * and applies the loss, reorder and drop rules; a coalesced buffer (the
+ * sender used GSO) is judged datagram by datagram
+ */
+void * proxyLoop(void *arg){
+    static char buf[PROXY_BUFFER], held[2][PROXY_BUFFER];
+    static struct run runs[2];
+    int held_len[2] = { 0, 0 };
+
+    while(!proxy.stop){
+        long wait = PROXY_HOLD_USEC;
+        if(proxy.rate > 0){
+            long next = bottleneckFlush();
+            if(next >= 0 && next < wait) wait = next;
+        }
+
+        struct pollfd pfd = { proxy.fd, POLLIN, 0 };
+        struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+        int rc = ppoll(&pfd, 1, &ts, NULL);
+        if(rc == 0 && wait < PROXY_HOLD_USEC) continue; /* the bottleneck's turn */
+
+        /*
+         * Nothing came after a held datagram -- let it go
+         */
+        if(rc == 0){
+            int dir=0;
+            for(;dir<2;dir++){
+                if(held_len[dir] > 0) proxySend(dir, held[dir], held_len[dir]);
+                held_len[dir] = 0;
+            }
+            continue;
+        }
+        if(rc < 0) continue;
+
+        struct sockaddr_in from;
+        struct iovec iov = { buf, sizeof(buf) };
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        int len = recvmsg(proxy.fd, &msg, 0);
+        if(len <= 0 || (msg.msg_flags & MSG_TRUNC)) continue;
+
+        int segment = len;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        for(;cmsg != NULL;cmsg = CMSG_NXTHDR(&msg, cmsg)){
+            if(cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) segment = *(int *)CMSG_DATA(cmsg);
+        }
+        if(segment <= 0 || segment > len) segment = len;
+
+        int dir = (from.sin_port == proxy.server.sin_port && from.sin_addr.s_addr == proxy.server.sin_addr.s_addr);
+        if(dir == 0){
+            proxy.client = from;
+            proxy.have_client = 1;
+        }
+        else if(!proxy.have_client) continue;
+
+        int offset = 0;
+        for(;offset < len;offset += segment){
+            char *data = buf + offset;
+            int size = (len - offset < segment) ? len - offset : segment;
+            int n = ++proxy.count[dir];
+
+            int i=0, drop=0;
+            for(;i<proxy.n_drops[dir];i++) if(proxy.drops[dir][i] == n) drop = 1;
+            if(proxy.loss > 0 && rand_r(&proxy.seed) % 100 < proxy.loss) drop = 1;
+            if(drop) continue;
+
+            if(proxy.rate > 0){
+                bottleneckAdd(dir, data, size);
+                continue;
+            }
+
+            if(held_len[dir] == 0 && proxy.reorder > 0 && rand_r(&proxy.seed) % 100 < proxy.reorder){
+                memcpy(held[dir], data, size);
+                held_len[dir] = size;
+                continue;
+            }
+            runAdd(dir, &runs[dir], data, size);
+            if(held_len[dir] > 0){
+                flushRun(dir, &runs[dir]);
+                proxySend(dir, held[dir], held_len[dir]);
+                held_len[dir] = 0;
+            }
+        }
+        flushRun(dir, &runs[dir]);
+    }
+    return NULL;
+}
+
+/*
+ * Send n bytes of a side's pattern, write_size bytes at a time
+ */
+int sendPattern(int fd, long n, int write_size, int side, long offset){
+    char *buf = malloc(write_size);
+    long sent = offset;
+    while(sent < n){
+        int size = (n - sent < write_size) ? (int)(n - sent) : write_size;
+        int i=0;
+        for(;i<size;i++) buf[i] = patternByte(sent + i, side);
+        if(sock352_write(fd, buf, size) != size){
+            printf("write failed at byte %ld\n", sent);
+            free(buf);
+            return -1;
+        }
+        sent += size;
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * Send bytes offset to n of a side's pattern with sock352_sendfile, from
+ * a temporary file that holds all of it -- asking for more than the file
+ * has checks that it stops at the end
+ */
+int sendPatternFile(int fd, long n, int side, long offset){
+    char path[] = "/tmp/test_transfer.XXXXXX";
+    int file_fd = mkstemp(path);
+    if(file_fd < 0){
+        printf("FAIL: creating the file to send: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(path);
+
+    static char buf[65536];
+    long written = 0;
+    while(written < n){
+        int size = (n - written < (long)sizeof(buf)) ? (int)(n - written) : (int)sizeof(buf);
+        int i=0;
+        for(;i<size;i++) buf[i] = patternByte(written + i, side);
+        if(write(file_fd, buf, size) != size){
+            printf("FAIL: writing the file to send: %s\n", strerror(errno));
+            close(file_fd);
+            return -1;
+        }
+        written += size;
+    }
+
+    ssize_t rc = sock352_sendfile(fd, file_fd, offset, n - offset + 1000);
+    close(file_fd);
+    if(rc != n - offset){
+        printf("sendfile returned %zd, expected %ld\n", rc, n - offset);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send bytes offset to n of a side's pattern with sock352_writev, one to
+ * five iovecs per call
+ */
+int sendPatternIov(int fd, long n, int side, long offset){
+    static char buf[2 * 65536 + 33000];
+    struct iovec iov[5];
+    long sent = offset;
+    int next = 0, call = 0;
+    while(sent < n){
+        int iovcnt = call++ % 5 + 1, total = 0, i = 0;
+        for(;i<iovcnt;i++){
+            int size = iov_sizes[next++ % N_IOV_SIZES];
+            if(size > n - sent - total) size = (int)(n - sent - total);
+            iov[i].iov_base = buf + total;
+            iov[i].iov_len = size;
+            int k=0;
+            for(;k<size;k++) buf[total + k] = patternByte(sent + total + k, side);
+            total += size;
+        }
+        if(sock352_writev(fd, iov, iovcnt) != total){
+            printf("writev failed at byte %ld\n", sent);
+            return -1;
+        }
+        sent += total;
+    }
+    return 0;
+}
+
+/*
+ * Read n bytes with sock352_readv, one to five iovecs per call with gaps
+ * between them, and check them against a side's pattern
+ */
+int checkPatternIov(int fd, long n, int side, const char *who){
+    static char buf[2 * 65536 + 33000 + 5 * IOV_GAP];
+    struct iovec iov[5];
+    long got = 0;
+    int next = 0, call = 0;
+    while(got < n){
+        int iovcnt = call++ % 5 + 1, want = 0, used = 0, i = 0;
+        memset(buf, IOV_GAP_BYTE, sizeof(buf));
+        for(;i<iovcnt;i++){
+            int size = iov_sizes[next++ % N_IOV_SIZES];
+            if(size > n - got - want) size = (int)(n - got - want);
+            iov[i].iov_base = buf + used;
+            iov[i].iov_len = size;
+            want += size;
+            used += size + IOV_GAP;
+        }
+        if(want == 0){
+            /*
+             * Only empty iovecs -- nothing to read, and nothing is lost
+             */
+            if(sock352_readv(fd, iov, iovcnt) != 0){
+                printf("FAIL: %s: readv into empty iovecs returned data\n", who);
+                return -1;
+            }
+            continue;
+        }
+
+        int rc = sock352_readv(fd, iov, iovcnt);
+        if(rc <= 0){
+            printf("FAIL: %s: readv returned %d after %ld of %ld bytes\n", who, rc, got, n);
+            return -1;
+        }
+        int left = rc;
+        for(i=0;i<iovcnt;i++){
+            char *base = (char *)iov[i].iov_base;
+            int filled = ((int)iov[i].iov_len < left) ? (int)iov[i].iov_len : left;
+            int k=0;
+            for(;k<filled;k++){
+                if(base[k] != patternByte(got + k, side)){
+                    printf("FAIL: %s: wrong byte at %ld\n", who, got + k);
+                    return -1;
+                }
+            }
+            for(k=filled;k<(int)iov[i].iov_len + IOV_GAP;k++){
+                if(base[k] != (char)IOV_GAP_BYTE){
+                    printf("FAIL: %s: readv wrote past the data of iovec %d\n", who, i);
+                    return -1;
+                }
+            }
+            got += filled;
+            left -= filled;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read n bytes and check them against a side's pattern
+ */
+int checkPattern(int fd, long n, int side, const char *who){
+    static char buf[65536];
+    long got = 0;
+    while(got < n){
+        int want = (n - got < (long)sizeof(buf)) ? (int)(n - got) : (int)sizeof(buf);
+        int rc = sock352_read(fd, buf, want);
+        if(rc <= 0){
+            printf("FAIL: %s: read returned %d after %ld of %ld bytes\n", who, rc, got, n);
+            return -1;
+        }
+        int i=0;
+        for(;i<rc;i++){
+            if(buf[i] != patternByte(got + i, side)){
+                printf("FAIL: %s: wrong byte at %ld\n", who, got + i);
+                return -1;
+            }
+        }
+        got += rc;
+    }
+    return 0;
+}
+
+/*
+ * Receive n bytes of a side's pattern into a temporary file with
+ * sock352_recvfile and check the file -- the data goes in at the file
+ * position, which doesn't start at 0
+ */
+int checkPatternFile(int fd, long n, int side, const char *who){
+    char path[] = "/tmp/test_transfer.XXXXXX";
+    int file_fd = mkstemp(path);
+    if(file_fd < 0){
+        printf("FAIL: %s: creating the file to receive into: %s\n", who, strerror(errno));
+        return -1;
+    }
+    unlink(path);
+
+    off_t start = 1000;
+    lseek(file_fd, start, SEEK_SET);
+    ssize_t rc = sock352_recvfile(fd, file_fd, n);
+    if(rc != n){
+        printf("FAIL: %s: recvfile returned %zd, expected %ld\n", who, rc, n);
+        close(file_fd);
+        return -1;
+    }
+    if(lseek(file_fd, 0, SEEK_CUR) != start + n){
+        printf("FAIL: %s: recvfile left the file position at %lld, expected %lld\n", who, (long long)lseek(file_fd, 0, SEEK_CUR), (long long)(start + n));
+        close(file_fd);
+        return -1;
+    }
+
+    static char buf[65536];
+    long got = 0;
+    while(got < n){
+        int want = (n - got < (long)sizeof(buf)) ? (int)(n - got) : (int)sizeof(buf);
+        if(pread(file_fd, buf, want, start + got) != want){
+            printf("FAIL: %s: reading the received file back\n", who);
+            close(file_fd);
+            return -1;
+        }
+        int i=0;
+        for(;i<want;i++){
+            if(buf[i] != patternByte(got + i, side)){
+                printf("FAIL: %s: wrong byte at %ld of the received file\n", who, got + i);
+                close(file_fd);
+                return -1;
+            }
+        }
+        got += want;
+    }
+    close(file_fd);
+    return 0;
+}
+
+/*
+ * Send bytes offset to n of a side's pattern the way the options say
+ * (the file calls only move the client's data)
+ */
+int sendData(int fd, long n, int write_size, int side, long offset){
+    if(file_mode && side == 0) return sendPatternFile(fd, n, side, offset);
+    if(iov_mode) return sendPatternIov(fd, n, side, offset);
+    return sendPattern(fd, n, write_size, side, offset);
+}
+
+/*
+ * Receive n bytes of a side's pattern the way the options say and check
+ * them
+ */
+int checkData(int fd, long n, int side, const char *who){
+    if(file_mode && side == 0) return checkPatternFile(fd, n, side, who);
+    if(iov_mode) return checkPatternIov(fd, n, side, who);
+    return checkPattern(fd, n, side, who);
+}
+
+/*
+ * The server end: accept one connection, check what the client sent,
+ * answer with the same amount
+ */
+int runServer(int port, long n, int write_size, int warm_up, int syn_data, int close_listener){
+    sock352_init(port);
+    int listen_fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(sock352_bind(listen_fd, &addr, sizeof(addr)) < 0 || sock352_listen(listen_fd, 5) < 0){
+        printf("FAIL: server: bind/listen failed\n");
+        return 1;
+    }
+
+    int len = sizeof(addr);
+    int fd;
+    if(warm_up){
+        char c;
+        if((fd = sock352_accept(listen_fd, &addr, &len)) < 0 || sock352_read(fd, &c, 1) != 0){
+            printf("FAIL: server: warm-up connection failed\n");
+            return 1;
+        }
+        sock352_close(fd);
+    }
+
+    if((fd = sock352_accept(listen_fd, &addr, &len)) < 0){
+        printf("FAIL: server: accept failed\n");
+        return 1;
+    }
+
+    /*
+     * The connection shares the listener's UDP socket, it must outlive it
+     */
+    if(close_listener && sock352_close(listen_fd) < 0){
+        printf("FAIL: server: closing the listener failed\n");
+        return 1;
+    }
+    if(checkData(fd, n, 0, "server") < 0) return 1;
+    if(sendData(fd, n, write_size, 1, 0) < 0) return 1;
+
+    /*
+     * With a cookie from the warm-up the data must have come in the SYN
+     */
+    sock352_stats_t stats;
+    sock352_getstats(listen_fd, &stats);
+    if(warm_up && syn_data > 0 && stats.fast_opens != 1){
+        printf("FAIL: server: %llu connections accepted on SYN data, expected 1\n", (unsigned long long)stats.fast_opens);
+        return 1;
+    }
+
+    sock352_close(fd);
+    if(!close_listener) sock352_close(listen_fd);
+    return 0;
+}
+
+/*
+ * The client end: connect through the proxy (with SYN data if asked),
+ * send the pattern, check the answer
+ */
+int runClient(int proxy_port, int local_port, long n, int write_size, int syn_data, int warm_up){
+    sock352_init2(proxy_port, local_port);
+    sockaddr_sock352_t addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_CS352;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd;
+    if(warm_up){
+        fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+        if(sock352_connect(fd, &addr, sizeof(addr)) < 0 || sock352_close(fd) < 0){
+            printf("FAIL: client: warm-up connection failed\n");
+            return 1;
+        }
+    }
+    fd = sock352_socket(AF_CS352, SOCK_STREAM, 0);
+
+    if(syn_data > n) syn_data = n;
+    char *data = malloc(syn_data + 1);
+    int i=0;
+    for(;i<syn_data;i++) data[i] = patternByte(i, 0);
+    if(sock352_connect_with_data(fd, &addr, sizeof(addr), data, syn_data) < 0){
+        printf("FAIL: client: connect failed\n");
+        return 1;
+    }
+    free(data);
+
+    if(sendData(fd, n, write_size, 0, syn_data) < 0) return 1;
+    if(checkData(fd, n, 1, "client") < 0) return 1;
+
+    sock352_close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    long n = 1000000;
+    int write_size = 8192, syn_data = 0, warm_up = 0, close_listener = 0, timeout = 30, c;
+    unsigned int seed = 352;
+
+    setvbuf(stdout, NULL, _IOLBF, 0); /* keep the two processes' lines whole */
+    memset(&proxy, 0, sizeof(proxy));
+    while((c = getopt(argc, argv, "n:w:D:kcFvl:r:d:q:o:t:s:")) != -1){
+        switch(c){
+            case 'n': n = atol(optarg); break;
+            case 'w': write_size = atoi(optarg); break;
+            case 'D': syn_data = atoi(optarg); break;
+            case 'k': warm_up = 1; break;
+            case 'c': close_listener = 1; break;
+            case 'F': file_mode = 1; break;
+            case 'v': iov_mode = 1; break;
+            case 'l': proxy.loss = atoi(optarg); break;
+            case 'r': proxy.reorder = atoi(optarg); break;
+            case 'd': {
+                int dir = (optarg[0] == 's');
+                if(proxy.n_drops[dir] < MAX_DROPS) proxy.drops[dir][proxy.n_drops[dir]++] = atoi(optarg + 1);
+                break;
+            }
+            case 'q': {
+                char *queue = strchr(optarg, ':');
+                proxy.rate = atol(optarg) * 1000;
+                proxy.queue_bytes = (queue != NULL) ? atoi(queue + 1) * 1000 : 64000;
+                break;
+            }
+            case 'o': putenv(optarg); break;
+            case 't': timeout = atoi(optarg); break;
+            case 's': seed = atoi(optarg); break;
+            default:
+                printf("usage: %s [-n bytes] [-w write size] [-D SYN data] [-k] [-c] [-F] [-v] [-l loss %%] [-r reorder %%] [-d c<N>|s<N>] [-q KB/s:queue KB] [-o NAME=VALUE] [-t sec] [-s seed]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(write_size <= 0) write_size = 1;
+    proxy.seed = seed;
+    if(proxy.rate > 0) proxy.delays = malloc(PROXY_MAX_DELAYS * sizeof(uint64_t));
+
+    int base = 20000 + (getpid() % 2000) * 16;
+    int server_port = base, proxy_port = base + 1, client_port = base + 2;
+
+    /*
+     * The server runs in its own process (its own library instance)
+     */
+    fflush(stdout);
+    signal(SIGALRM, timedOut);
+    pid_t pid = fork();
+    if(pid == 0){
+        alarm(timeout);
+        exit(runServer(server_port, n, write_size, warm_up, syn_data, close_listener));
+    }
+    server_pid = pid;
+    alarm(timeout);
+
+    proxy.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(proxy_port);
+    if(bind(proxy.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        printf("FAIL: proxy bind: %s\n", strerror(errno));
+        kill(pid, SIGKILL);
+        return 1;
+    }
+    int size = 4 * 1024 * 1024;
+    setsockopt(proxy.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(proxy.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    int on = 1;
+    setsockopt(proxy.fd, SOL_UDP, UDP_GRO, &on, sizeof(on)); /* keep GSO sends coalesced, see proxyLoop */
+    proxy.server = addr;
+    proxy.server.sin_port = htons(server_port);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, proxyLoop, NULL);
+    usleep(200000); /* let the server get to listen */
+
+    uint64_t start = proxyNow();
+    int rc = runClient(proxy_port, client_port, n, write_size, syn_data, warm_up);
+    double seconds = (proxyNow() - start) / 1e6;
+
+    /*
+     * The server waits for a client that gave up -- don't wait for it
+     */
+    if(rc != 0) kill(pid, SIGKILL);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    proxy.stop = 1;
+    pthread_join(thread, NULL);
+
+    if(rc == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)){
+        if(WIFSIGNALED(status)) printf("FAIL: server died with signal %d\n", WTERMSIG(status));
+        rc = 1;
+    }
+    if(rc == 0) printf("PASS: %ld bytes each way (%d/%d datagrams through the proxy)\n", n, proxy.count[0], proxy.count[1]);
+
+    /*
+     * What the bottleneck saw -- drops and queueing delays
+     */
+    if(proxy.rate > 0){
+        int kept = (proxy.queued < PROXY_MAX_DELAYS) ? proxy.queued : PROXY_MAX_DELAYS;
+        qsort(proxy.delays, kept, sizeof(uint64_t), compareDelays);
+        printf("bottleneck: %d of %d datagrams dropped (%.2f%%), queueing delay median %llu usec, p99 %llu usec, %.2f s\n",
+               proxy.queue_drops, proxy.queued + proxy.queue_drops,
+               100.0 * proxy.queue_drops / (proxy.queued + proxy.queue_drops > 0 ? proxy.queued + proxy.queue_drops : 1),
+               (unsigned long long)(kept > 0 ? proxy.delays[kept / 2] : 0),
+               (unsigned long long)(kept > 0 ? proxy.delays[(int)(kept * 0.99)] : 0), seconds);
+    }
+    return rc;
+}